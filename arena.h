@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A bump allocator for what lives for one frame only. reset() runs the destructors and frees everything at once
+// but keeps the memory: when a frame did not fit in one block, the blocks are merged into one big enough, so the
+// next frames of the same kind don't allocate at all. Not thread safe, one per render context.
+class Arena {
+public:
+    explicit Arena(size_t capacity = 64 << 10) : blocks(), used(0), total(0), allocated(0), destructors(nullptr) {
+        grow(capacity);
+    }
+
+    Arena(const Arena &) = delete;
+
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena() {
+        reset();
+    }
+
+    // at most alignof(std::max_align_t)
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+        Block &b = blocks.back();
+        size_t offset = (used + align - 1) / align * align;
+        if (offset + size > b.size) {
+            grow(std::max(2 * b.size, size + align));
+            return allocate(size, align);
+        }
+        used = offset + size;
+        return b.data.get() + offset;
+    }
+
+    // destroyed by reset()
+    template<typename T, typename... Args>
+    T *make(Args &&... args) {
+        return adopt(new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...));
+    }
+
+    // n default constructed Ts in a row
+    template<typename T>
+    T *make_array(size_t n) {
+        T *array = static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+        for (size_t i = 0; i < n; i++) adopt(new(array + i) T());
+        return array;
+    }
+
+    // destroys the objects in the reverse order of make()
+    void reset() {
+        for (Destructor *d = destructors; d; d = d->next) d->destroy(d->object);
+        destructors = nullptr;
+        if (blocks.size() > 1) {
+            size_t size = total;
+            blocks.clear();
+            total = 0;
+            grow(size);
+        }
+        used = 0;
+        allocated = 0;
+    }
+
+    // bytes of the objects made since the last reset()
+    size_t size() const {
+        return allocated;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<unsigned char[]> data;
+        size_t size;
+    };
+
+    struct Destructor {
+        void (*destroy)(void *);
+        void *object;
+        Destructor *next;
+    };
+
+    std::vector<Block> blocks;
+    size_t used;  // in the last block
+    size_t total; // of all the blocks
+    size_t allocated;
+    Destructor *destructors;
+
+    template<typename T>
+    T *adopt(T *object) {
+        if (!std::is_trivially_destructible<T>::value) {
+            void *slot = allocate(sizeof(Destructor), alignof(Destructor));
+            destructors = new(slot) Destructor{[](void *p) { static_cast<T *>(p)->~T(); }, object, destructors};
+        }
+        allocated += sizeof(T);
+        return object;
+    }
+
+    void grow(size_t size) {
+        blocks.push_back({std::unique_ptr<unsigned char[]>(new unsigned char[size]), size});
+        total += size;
+        used = 0;
+    }
+};
@@ -0,0 +1,24 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "meshstream.h"
+
+// Builds <obj>.chunks for every model, what MeshStream (and render stream=1) reads, see meshstream.h.
+int main(int argc, char **argv) {
+    int faces_per_chunk = 4096;
+    int first = 1;
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+        faces_per_chunk = std::atoi(argv[2]);
+        first = 3;
+    }
+    if (first >= argc || faces_per_chunk <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [-n faces_per_chunk] obj/model.obj..." << std::endl;
+        return 1;
+    }
+    int errors = 0;
+    for (int m = first; m < argc; m++) {
+        if (!build_chunks(argv[m], std::string(argv[m]) + ".chunks", faces_per_chunk)) errors++;
+    }
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,55 @@
+#include <iostream>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Sends one job built from the command line (or one job per line of stdin) to a render server
+// and prints the replies, see server.h for the protocol.
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " socket [render obj=... out=... | shutdown]" << std::endl;
+        return 1;
+    }
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *) &addr, sizeof(addr)) < 0) {
+        std::cerr << "can't connect to " << argv[1] << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    std::string request;
+    if (argc > 2) {
+        for (int i = 2; i < argc; i++) request += std::string(argv[i]) + (i + 1 < argc ? " " : "\n");
+    } else {
+        std::string line;
+        while (std::getline(std::cin, line)) request += line + "\n";
+    }
+    for (size_t sent = 0; sent < request.size();) {
+        ssize_t n = send(fd, request.data() + sent, request.size() - sent, 0);
+        if (n <= 0) {
+            std::cerr << "can't send the request\n";
+            return 1;
+        }
+        sent += n;
+    }
+    shutdown(fd, SHUT_WR);
+
+    int errors = 0;
+    std::string reply;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = recv(fd, chunk, sizeof(chunk), 0)) > 0) reply.append(chunk, static_cast<size_t>(n));
+    close(fd);
+    for (size_t pos = 0, nl; (nl = reply.find('\n', pos)) != std::string::npos; pos = nl + 1) {
+        std::string line = reply.substr(pos, nl - pos);
+        errors += line.compare(0, 2, "ok") != 0 && line.compare(0, 9, "progress ") != 0;
+        std::cout << line << std::endl;
+    }
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// How a depth is stored, see DepthBuffer. load() gives back what store() got through quantize(): the rasterizer
+// quantizes every depth before the test, so equal depths stay equal (the second pass of a z prepass) whatever the
+// format.
+struct DepthFloat32 {
+    static const int BYTES = 4;
+
+    static float quantize(float z) {
+        return z;
+    }
+
+    static float load(const unsigned char *p) {
+        float z;
+        memcpy(&z, p, sizeof(z));
+        return z;
+    }
+
+    static void store(unsigned char *p, float z) {
+        memcpy(p, &z, sizeof(z));
+    }
+};
+
+// z in [0, 1] as round(z * (2^BITS - 1)), little endian on BYTES bytes, clamped outside of [0, 1]
+template<int BITS>
+struct DepthUnorm {
+    static const int BYTES = (BITS + 7) / 8;
+    static constexpr uint32_t MAX = (1u << BITS) - 1;
+
+    static uint32_t encode(float z) {
+        return z > 0.f ? z < 1.f ? static_cast<uint32_t>(z * MAX + .5f) : MAX : 0;
+    }
+
+    static float decode(uint32_t code) {
+        return static_cast<float>(code) * (1.f / MAX);
+    }
+
+    static float quantize(float z) {
+        return decode(encode(z));
+    }
+
+    static float load(const unsigned char *p) {
+        uint32_t code = 0;
+        for (int i = 0; i < BYTES; i++) code |= static_cast<uint32_t>(p[i]) << 8 * i;
+        return decode(code);
+    }
+
+    static void store(unsigned char *p, float z) {
+        uint32_t code = encode(z);
+        for (int i = 0; i < BYTES; i++) p[i] = static_cast<unsigned char>(code >> 8 * i);
+    }
+};
+
+using DepthUnorm24 = DepthUnorm<24>;
+using DepthUnorm16 = DepthUnorm<16>;
+
+// The zbuffer. Pixels are stored row by row in one of the formats above and cleared lazily: clear() only flags every
+// TILE x TILE tile as cleared, a tile holds the clear depth until touch() writes it into the tile's memory, just
+// before the rasterizer reads it. So a clear costs one byte per tile and the tiles nothing is drawn to are neither
+// read nor written.
+class DepthBuffer {
+public:
+    // FLOAT32 is exact. The depths are already reversed (the near plane at 1, far away objects towards 0, where a
+    // float is the most precise), so that is also the format for distant geometry. UNORM24 and UNORM16 are evenly
+    // spaced and take 3/4 and 1/2 of the memory traffic.
+    enum Format {
+        FLOAT32, UNORM24, UNORM16,
+    };
+
+    static const int TILE = 32;
+
+    DepthBuffer() = default;
+
+    // every tile cleared, the memory is only reallocated when larger than all the previous sizes
+    void resize(int width, int height) {
+        this->width = width;
+        this->height = height;
+        tilesX = (width + TILE - 1) / TILE;
+        tilesY = (height + TILE - 1) / TILE;
+        data.resize(static_cast<size_t>(width) * height * bytes);
+        cleared.assign(static_cast<size_t>(tilesX) * tilesY, 1);
+    }
+
+    void set_format(Format format) {
+        depthFormat = format;
+        bytes = format == FLOAT32 ? DepthFloat32::BYTES : format == UNORM24 ? DepthUnorm24::BYTES : DepthUnorm16::BYTES;
+        resize(width, height);
+    }
+
+    Format format() const {
+        return depthFormat;
+    }
+
+    int bytespp() const {
+        return bytes;
+    }
+
+    // the memory of the pixels, width * height * bytespp() bytes
+    size_t size() const {
+        return static_cast<size_t>(width) * height * bytes;
+    }
+
+    // every tile to value, without touching the pixels
+    void clear(float value) {
+        clearDepth = value;
+        std::fill(cleared.begin(), cleared.end(), 1);
+    }
+
+    // the tile (tx, ty) back to the clear depth
+    void clear_tile(int tx, int ty) {
+        cleared[tx + ty * tilesX] = 1;
+    }
+
+    // the pixels from (x0, y0) to (x1, y1) are about to be read: their cleared tiles get the clear depth
+    void touch(int x0, int y0, int x1, int y1) {
+        for (int ty = y0 / TILE; ty <= y1 / TILE; ty++) {
+            for (int tx = x0 / TILE; tx <= x1 / TILE; tx++) {
+                if (cleared[tx + ty * tilesX]) fill_tile(tx, ty);
+            }
+        }
+    }
+
+    // the decoded depth at (x, y), the clear depth in a cleared tile
+    float get(int x, int y) const {
+        if (cleared[x / TILE + y / TILE * tilesX]) return quantized(clearDepth);
+        const unsigned char *p = pixel(x + y * width);
+        switch (depthFormat) {
+            case UNORM24:
+                return DepthUnorm24::load(p);
+            case UNORM16:
+                return DepthUnorm16::load(p);
+            default:
+                return DepthFloat32::load(p);
+        }
+    }
+
+    // the tiles written since the last clear
+    int touched() const {
+        return static_cast<int>(std::count(cleared.begin(), cleared.end(), 0));
+    }
+
+    unsigned char *pixel(int index) {
+        return data.data() + static_cast<size_t>(index) * bytes;
+    }
+
+    const unsigned char *pixel(int index) const {
+        return data.data() + static_cast<size_t>(index) * bytes;
+    }
+
+private:
+    float quantized(float z) const {
+        switch (depthFormat) {
+            case UNORM24:
+                return DepthUnorm24::quantize(z);
+            case UNORM16:
+                return DepthUnorm16::quantize(z);
+            default:
+                return z;
+        }
+    }
+
+    template<typename Codec>
+    void fill_rows(int tx, int ty) {
+        unsigned char value[Codec::BYTES];
+        Codec::store(value, clearDepth);
+        const int x0 = tx * TILE, x1 = std::min(x0 + TILE, width);
+        for (int y = ty * TILE; y < std::min(ty * TILE + TILE, height); y++) {
+            unsigned char *p = pixel(x0 + y * width);
+            for (int x = x0; x < x1; x++, p += Codec::BYTES) memcpy(p, value, Codec::BYTES);
+        }
+    }
+
+    void fill_tile(int tx, int ty) {
+        switch (depthFormat) {
+            case UNORM24:
+                fill_rows<DepthUnorm24>(tx, ty);
+                break;
+            case UNORM16:
+                fill_rows<DepthUnorm16>(tx, ty);
+                break;
+            default:
+                fill_rows<DepthFloat32>(tx, ty);
+                break;
+        }
+        cleared[tx + ty * tilesX] = 0;
+    }
+
+    Format depthFormat = FLOAT32;
+    int bytes = DepthFloat32::BYTES;
+    int width = 0;
+    int height = 0;
+    int tilesX = 0;
+    int tilesY = 0;
+    float clearDepth = 0.f;
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> cleared; // per tile, 1 while it holds clearDepth whatever its memory
+};
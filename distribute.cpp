@@ -0,0 +1,232 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "distribute.h"
+#include "server.h"
+#include "trace.h"
+
+namespace {
+    const int MAX_WORKER_FAILURES = 3; // in a row, then the worker is dropped
+    const int MAX_JOB_ERRORS = 3;
+    const int REPLY_TIMEOUT_S = 600;   // a worker that takes longer is taken for dead
+
+    // one worker connection, the replies go through a buffer: a line, then the pixels
+    class Connection {
+    public:
+        explicit Connection(const std::string &address) : address(address) {}
+
+        ~Connection() {
+            close();
+        }
+
+        bool open() {
+            close();
+            fd = connect_to(address);
+            if (fd < 0) return false;
+            timeval timeout = {REPLY_TIMEOUT_S, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            return true;
+        }
+
+        void close() {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+            buffer.clear();
+        }
+
+        bool is_open() const {
+            return fd >= 0;
+        }
+
+        bool send_line(const std::string &line) {
+            std::string msg = line + "\n";
+            for (size_t sent = 0; sent < msg.size();) {
+                ssize_t n = send(fd, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL); // a dead worker fails here
+                if (n <= 0) return false;
+                sent += n;
+            }
+            return true;
+        }
+
+        bool read_line(std::string &line) {
+            size_t nl;
+            while ((nl = buffer.find('\n')) == std::string::npos) {
+                if (!fill()) return false;
+            }
+            line = buffer.substr(0, nl);
+            buffer.erase(0, nl + 1);
+            return true;
+        }
+
+        bool read(unsigned char *data, size_t size) {
+            size_t n = std::min(size, buffer.size());
+            memcpy(data, buffer.data(), n);
+            buffer.erase(0, n);
+            while (n < size) {
+                ssize_t got = recv(fd, data + n, size - n, 0);
+                if (got <= 0) return false;
+                n += got;
+            }
+            return true;
+        }
+
+        const std::string address;
+
+    private:
+        bool fill() {
+            char chunk[4096];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) return false;
+            buffer.append(chunk, static_cast<size_t>(n));
+            return true;
+        }
+
+        int fd = -1;
+        std::string buffer;
+    };
+
+    enum Outcome {
+        RENDERED, REFUSED, BROKEN,
+    };
+
+    // the pixels of one job into frame, resized as needed
+    Outcome run(Connection &connection, const std::string &line, TGAImage &frame) {
+        if (!connection.is_open() && !connection.open()) return BROKEN;
+        std::string reply;
+        if (!connection.send_line(line) || !connection.read_line(reply)) return BROKEN;
+        int width, height, bytespp;
+        if (sscanf(reply.c_str(), "pixels %d %d %d", &width, &height, &bytespp) != 3 || width <= 0 || height <= 0 ||
+            (bytespp != TGAImage::GRAYSCALE && bytespp != TGAImage::RGB && bytespp != TGAImage::RGBA)) {
+            std::cerr << connection.address << ": " << reply << "\n";
+            return REFUSED;
+        }
+        if (frame.get_width() != width || frame.get_height() != height || frame.get_bytespp() != bytespp) {
+            frame = TGAImage(width, height, bytespp);
+        }
+        return connection.read(frame.buffer(), static_cast<size_t>(width) * height * bytespp) ? RENDERED : BROKEN;
+    }
+
+    // Runs every job on the workers, one thread per connection. done(i, frame) gets the frame of jobs[i], on the
+    // thread of its worker (the frame is reused for the worker's next job), and returns false to stop everything.
+    bool dispatch(const std::vector<RenderJob> &jobs, const std::vector<std::string> &workers,
+                  const std::function<bool(size_t, TGAImage &)> &done) {
+        std::vector<std::string> lines;
+        for (auto &job : jobs) {
+            RenderJob sent = job;
+            sent.output.clear(); // out=-
+            lines.push_back(format_job(sent));
+        }
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<size_t> pending;
+        for (size_t i = 0; i < jobs.size(); i++) pending.push_back(i);
+        std::vector<int> errors(jobs.size(), 0);
+        size_t remaining = jobs.size();
+        int alive = static_cast<int>(workers.size()), retried = 0;
+        bool failed = workers.empty() && !jobs.empty();
+        if (failed) std::cerr << "no worker to render on\n";
+
+        auto work = [&](const std::string &address) {
+            Connection connection(address);
+            TGAImage frame;
+            int failures = 0;
+            for (;;) {
+                size_t i;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&] { return failed || !remaining || !pending.empty(); });
+                    if (failed || pending.empty()) return;
+                    i = pending.front();
+                    pending.pop_front();
+                }
+                TRACE_SCOPE("remote job");
+                Outcome outcome = run(connection, lines[i], frame);
+                bool accepted = outcome == RENDERED && done(i, frame);
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.notify_all();
+                if (outcome == RENDERED) {
+                    failures = 0;
+                    remaining--;
+                    failed |= !accepted;
+                    continue;
+                }
+                pending.push_back(i); // after the others, it may be what failed
+                retried++;
+                if (outcome == REFUSED && ++errors[i] >= MAX_JOB_ERRORS) {
+                    std::cerr << "every attempt at a job failed: " << lines[i] << "\n";
+                    failed = true;
+                }
+                if (outcome == BROKEN) {
+                    connection.close();
+                    if (++failures >= MAX_WORKER_FAILURES) {
+                        std::cerr << "worker " << address << " dropped after " << failures << " failures\n";
+                        if (!--alive) {
+                            std::cerr << "no worker left\n";
+                            failed = true;
+                        }
+                        return;
+                    }
+                    // the others take the job meanwhile, the render does not wait for the end of the backoff
+                    wake.wait_for(lock, std::chrono::milliseconds(100 << failures), [&] { return failed || !remaining; });
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (auto &address : workers) threads.emplace_back(work, address);
+        for (auto &t : threads) t.join();
+        std::cerr << "# distributed " << jobs.size() << " jobs over " << workers.size() << " workers, " << retried
+                  << " retried" << std::endl;
+        return !failed && !remaining;
+    }
+}
+
+bool glRenderDistributed(const RenderJob &job, const std::vector<std::string> &workers, TGAImage &framebuffer,
+                         int region) {
+    TRACE_SCOPE("distributed render");
+    std::vector<RenderJob> regions;
+    for (int y = 0; y < job.height; y += region) {
+        for (int x = 0; x < job.width; x += region) {
+            RenderJob part = job;
+            part.frame_x = x, part.frame_y = y, part.frame_width = job.width, part.frame_height = job.height;
+            part.width = std::min(region, job.width - x);
+            part.height = std::min(region, job.height - y);
+            regions.push_back(part);
+        }
+    }
+    if (framebuffer.get_width() != job.width || framebuffer.get_height() != job.height ||
+        framebuffer.get_bytespp() != TGAImage::RGB) {
+        framebuffer = TGAImage(job.width, job.height, TGAImage::RGB);
+    }
+    const int bytespp = framebuffer.get_bytespp();
+    return dispatch(regions, workers, [&](size_t i, TGAImage &pixels) {
+        const RenderJob &part = regions[i];
+        if (pixels.get_width() != part.width || pixels.get_height() != part.height || pixels.get_bytespp() != bytespp) {
+            std::cerr << "a worker sent a region of the wrong size\n";
+            return false;
+        }
+        // the regions are disjoint, the worker threads copy theirs at the same time
+        const size_t row = static_cast<size_t>(part.width) * bytespp;
+        for (int y = 0; y < part.height; y++) {
+            memcpy(framebuffer.buffer() + ((part.frame_y + y) * static_cast<size_t>(job.width) + part.frame_x) * bytespp,
+                   pixels.buffer() + y * row, row);
+        }
+        return true;
+    });
+}
+
+// the framebuffer rows go bottom up, as glRender() writes them
+bool glRenderDistributed(const std::vector<RenderJob> &jobs, const std::vector<std::string> &workers) {
+    TRACE_SCOPE("distributed sequence");
+    return dispatch(jobs, workers, [&](size_t i, TGAImage &frame) {
+        return frame.write_tga_file(jobs[i].output.data(), true, true);
+    });
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "render.h"
+#include "tgaimage.h"
+
+// Coordinator side of distributed rendering: the jobs go to render servers (see server.h), the workers, as
+// format_job() lines with out=-, and their pixels come back on the socket. workers are server addresses, one
+// connection each with one job at a time: an address given twice gets two connections, so two of the server's
+// threads. The obj paths are the workers'.
+// A job whose connection fails (refused, closed or timed out) is sent again to the next worker free, a worker is
+// dropped after 3 failures in a row and retried meanwhile. A job answered with an error is tried 3 times, then the
+// render fails, as it does once every worker is dropped. Both return false with the reason on std::cerr.
+
+// The frame of job cut in regions of at most region x region pixels, rendered by the workers and assembled into
+// framebuffer (job.width x job.height, RGB). The instances of the job are not sent.
+bool glRenderDistributed(const RenderJob &job, const std::vector<std::string> &workers, TGAImage &framebuffer,
+                         int region = 256);
+
+// one frame per job, each written to its job's output here as it comes back
+bool glRenderDistributed(const std::vector<RenderJob> &jobs, const std::vector<std::string> &workers);
@@ -0,0 +1,285 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include "framesink.h"
+#include "trace.h"
+
+namespace {
+    // writev() until everything is out, pipes take a part of it at a time
+    bool write_all(int fd, iovec *iov, int n) {
+        while (n > 0) {
+            ssize_t written = writev(fd, iov, std::min(n, IOV_MAX));
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return false;
+            for (; n > 0 && static_cast<size_t>(written) >= iov->iov_len; iov++, n--) written -= iov->iov_len;
+            if (n > 0) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+        return true;
+    }
+
+    int create_file(const std::string &name) {
+        int fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) std::cerr << "can't open file " << name << ": " << strerror(errno) << "\n";
+        return fd;
+    }
+
+    // the pixels top down, RGB(A) instead of BGR(A)
+    void top_down_rgb(TGAImage &frame, std::vector<unsigned char> &pixels, int bytespp) {
+        const int width = frame.get_width(), height = frame.get_height(), in = frame.get_bytespp();
+        pixels.resize(static_cast<size_t>(width) * height * bytespp);
+        unsigned char *dst = pixels.data();
+        for (int y = height - 1; y >= 0; y--) {
+            const unsigned char *src = frame.buffer() + static_cast<size_t>(y) * width * in;
+            for (int x = 0; x < width; x++, src += in, dst += bytespp) {
+                if (in == TGAImage::GRAYSCALE) {
+                    std::fill_n(dst, bytespp, src[0]);
+                    continue;
+                }
+                dst[0] = src[2], dst[1] = src[1], dst[2] = src[0];
+                if (bytespp == TGAImage::RGBA) dst[3] = in == TGAImage::RGBA ? src[3] : 255;
+            }
+        }
+    }
+
+    void wait(sem_t *sem) {
+        while (sem_wait(sem) < 0 && errno == EINTR) {}
+    }
+
+    // false once the deadline (CLOCK_REALTIME) has passed
+    bool wait_until(sem_t *sem, const timespec &deadline) {
+        for (;;) {
+            if (sem_timedwait(sem, &deadline) == 0) return true;
+            if (errno != EINTR) return false;
+        }
+    }
+
+    timespec deadline_in(int seconds) {
+        timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += seconds;
+        return t;
+    }
+
+    const uint32_t RING_MAGIC = 0x474e4952; // "RING"
+    const size_t RING_HEADER = 256;         // the slots start there, cache line aligned
+    const int RING_TIMEOUT_S = 30;          // a consumer that reads nothing for that long is taken for dead
+}
+
+bool write_rows_top_down(int fd, const unsigned char *pixels, int width, int height, int bytespp,
+                         std::vector<iovec> &rows) {
+    const size_t row = static_cast<size_t>(width) * bytespp;
+    rows.resize(static_cast<size_t>(height));
+    for (int y = 0; y < height; y++) {
+        rows[y].iov_base = const_cast<unsigned char *>(pixels) + (height - 1 - y) * row;
+        rows[y].iov_len = row;
+    }
+    return write_all(fd, rows.data(), height);
+}
+
+bool TgaFileSink::write(TGAImage &frame, const std::string &name) {
+    if (rle) return frame.write_tga_file(name.c_str(), true, true);
+    TRACE_SCOPE("tga writev");
+    static const unsigned char footer[26] = {0, 0, 0, 0, 0, 0, 0, 0, 'T', 'R', 'U', 'E', 'V', 'I', 'S', 'I', 'O', 'N',
+                                             '-', 'X', 'F', 'I', 'L', 'E', '.', '\0'};
+    TGA_Header header;
+    memset((void *) &header, 0, sizeof(header));
+    header.bitsperpixel = frame.get_bytespp() << 3;
+    header.width = frame.get_width();
+    header.height = frame.get_height();
+    header.datatypecode = frame.get_bytespp() == TGAImage::GRAYSCALE ? 3 : 2;
+    header.imagedescriptor = 0x00; // bottom-left origin, the framebuffer's row order
+    int fd = create_file(name);
+    if (fd < 0) return false;
+    iovec iov[3] = {{&header, sizeof(header)},
+                    {frame.buffer(), static_cast<size_t>(frame.get_width()) * frame.get_height() * frame.get_bytespp()},
+                    {const_cast<unsigned char *>(footer), sizeof(footer)}};
+    bool ok = write_all(fd, iov, 3);
+    ok = ::close(fd) == 0 && ok;
+    if (!ok) std::cerr << "can't write the tga file " << name << "\n";
+    return ok;
+}
+
+bool PpmFileSink::write(TGAImage &frame, const std::string &name) {
+    TRACE_SCOPE("ppm write");
+    const bool gray = frame.get_bytespp() == TGAImage::GRAYSCALE;
+    top_down_rgb(frame, pixels, gray ? 1 : 3);
+    std::string header = std::string(gray ? "P5\n" : "P6\n") + std::to_string(frame.get_width()) + " " +
+                         std::to_string(frame.get_height()) + "\n255\n";
+    int fd = create_file(name);
+    if (fd < 0) return false;
+    iovec iov[2] = {{&header[0], header.size()}, {pixels.data(), pixels.size()}};
+    bool ok = write_all(fd, iov, 2);
+    ok = ::close(fd) == 0 && ok;
+    if (!ok) std::cerr << "can't write the ppm file " << name << "\n";
+    return ok;
+}
+
+RawStreamSink::RawStreamSink(const std::string &path, bool rgb) : fd(-1), owned(path != "-"), rgb(rgb) {
+    fd = owned ? create_file(path) : STDOUT_FILENO;
+}
+
+RawStreamSink::~RawStreamSink() {
+    if (owned && fd >= 0) ::close(fd);
+}
+
+bool RawStreamSink::write(TGAImage &frame, const std::string &) {
+    TRACE_SCOPE("raw write");
+    if (fd < 0) return false;
+    bool ok;
+    if (rgb) {
+        top_down_rgb(frame, pixels, frame.get_bytespp());
+        iovec iov = {pixels.data(), pixels.size()};
+        ok = write_all(fd, &iov, 1);
+    } else {
+        ok = write_rows_top_down(fd, frame.buffer(), frame.get_width(), frame.get_height(), frame.get_bytespp(),
+                                 rows);
+    }
+    if (!ok) std::cerr << "can't write a raw frame: " << strerror(errno) << "\n";
+    return ok;
+}
+
+FrameRing::~FrameRing() {
+    if (header) munmap(header, size);
+    if (owner) shm_unlink(name.c_str());
+}
+
+bool FrameRing::create(const std::string &name, int width, int height, int bytespp, int slots) {
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        std::cerr << "can't create the shared memory " << name << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    const size_t frame_bytes = static_cast<size_t>(width) * height * bytespp;
+    size = RING_HEADER + frame_bytes * slots;
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(size)) == 0) p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    this->name = name;
+    owner = true;
+    if (p == MAP_FAILED) {
+        std::cerr << "can't map " << size << " bytes of shared memory " << name << "\n";
+        return false;
+    }
+    header = static_cast<Header *>(p);
+    header->width = width, header->height = height, header->bytespp = bytespp, header->slots = slots;
+    header->frame_bytes = frame_bytes;
+    sem_init(&header->free, 1, static_cast<unsigned>(slots));
+    sem_init(&header->filled, 1, 0);
+    header->written = 0;
+    header->closed = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = RING_MAGIC; // last, a consumer opening meanwhile sees no ring yet
+    return true;
+}
+
+bool FrameRing::open(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) return false;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= RING_HEADER) {
+        p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+    header = static_cast<Header *>(p);
+    size = static_cast<size_t>(st.st_size);
+    if (header->magic != RING_MAGIC) {
+        munmap(header, size);
+        header = nullptr;
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    this->name = name;
+    read = 0;
+    return true;
+}
+
+unsigned char *FrameRing::slot(uint64_t frame) const {
+    return reinterpret_cast<unsigned char *>(header) + RING_HEADER + (frame % header->slots) * header->frame_bytes;
+}
+
+bool FrameRing::push(TGAImage &frame) {
+    if (frame.get_width() != header->width || frame.get_height() != header->height ||
+        frame.get_bytespp() != header->bytespp) {
+        std::cerr << "a frame of another size than the ring's " << header->width << "x" << header->height << "\n";
+        return false;
+    }
+    TRACE_SCOPE("ring push"); // waiting for the consumer shows up here
+    if (!wait_until(&header->free, deadline_in(RING_TIMEOUT_S))) {
+        std::cerr << "no frame of the ring " << name << " was read for " << RING_TIMEOUT_S << " s\n";
+        return false;
+    }
+    memcpy(slot(header->written), frame.buffer(), header->frame_bytes);
+    header->written++;
+    sem_post(&header->filled);
+    return true;
+}
+
+void FrameRing::close() {
+    header->closed = 1;
+    sem_post(&header->filled);
+}
+
+const unsigned char *FrameRing::next() {
+    wait(&header->filled);
+    if (read == header->written && header->closed) {
+        sem_post(&header->filled); // the end again on the next call
+        return nullptr;
+    }
+    return slot(read);
+}
+
+void FrameRing::release() {
+    read++;
+    sem_post(&header->free);
+}
+
+bool FrameRing::drain() {
+    const timespec deadline = deadline_in(RING_TIMEOUT_S);
+    int released = 0;
+    while (released < header->slots && wait_until(&header->free, deadline)) released++;
+    for (int i = 0; i < released; i++) sem_post(&header->free);
+    if (released == header->slots) return true;
+    std::cerr << header->slots - released << " frames of the ring " << name << " still unread after "
+              << RING_TIMEOUT_S << " s\n";
+    return false;
+}
+
+int FrameRing::width() const {
+    return header->width;
+}
+
+int FrameRing::height() const {
+    return header->height;
+}
+
+int FrameRing::bytespp() const {
+    return header->bytespp;
+}
+
+ShmRingSink::~ShmRingSink() {
+    if (!created) return;
+    ring.close();
+    ring.drain(); // the name goes away with the ring
+}
+
+bool ShmRingSink::write(TGAImage &frame, const std::string &) {
+    if (!created) {
+        created = ring.create(name, frame.get_width(), frame.get_height(), frame.get_bytespp(), slots);
+        if (!created) return false;
+    }
+    return ring.push(frame);
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <semaphore.h>
+#include <sys/uio.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "tgaimage.h"
+
+// Where FrameWriter puts the finished frames. They come as rendered, with the first row at the bottom. A sink is
+// only used by one thread at a time.
+class FrameSink {
+public:
+    virtual ~FrameSink() = default;
+
+    // name is the output of the job, the sinks that stream everything to one place ignore it
+    virtual bool write(TGAImage &frame, const std::string &name) = 0;
+};
+
+// one TGA file per frame, the uncompressed ones go out with a single writev() of the header, pixels and footer
+class TgaFileSink : public FrameSink {
+public:
+    explicit TgaFileSink(bool rle = true) : rle(rle) {}
+
+    bool write(TGAImage &frame, const std::string &name) override;
+
+private:
+    bool rle;
+};
+
+// one binary PPM (P6) file per frame, the rows are turned top down and RGB into a buffer kept between frames
+class PpmFileSink : public FrameSink {
+public:
+    bool write(TGAImage &frame, const std::string &name) override;
+
+private:
+    std::vector<unsigned char> pixels;
+};
+
+// Raw frames back to back on stdout or a named pipe, rows top down, what ffmpeg -f rawvideo -pix_fmt bgr24 (bgra,
+// gray) -s WxH -i <path> reads. The rows are written straight from the framebuffer, one iovec each. With rgb the
+// channels are swapped into a buffer first, for -pix_fmt rgb24 (rgba).
+class RawStreamSink : public FrameSink {
+public:
+    // "-" is stdout, anything else is opened for writing: a FIFO blocks until a reader opens it
+    explicit RawStreamSink(const std::string &path, bool rgb = false);
+
+    ~RawStreamSink() override;
+
+    bool is_open() const {
+        return fd >= 0;
+    }
+
+    bool write(TGAImage &frame, const std::string &name) override;
+
+private:
+    int fd;
+    bool owned;
+    bool rgb;
+    std::vector<unsigned char> pixels;
+    std::vector<iovec> rows;
+};
+
+// A ring of frames in POSIX shared memory, between a producer (ShmRingSink) and one consumer process that maps it
+// and reads the pixels in place. The producer waits while every slot is full, the consumer while none is.
+// Slots hold the frames as rendered, first row at the bottom, BGR(A).
+class FrameRing {
+public:
+    FrameRing() = default;
+
+    FrameRing(const FrameRing &) = delete;
+
+    FrameRing &operator=(const FrameRing &) = delete;
+
+    // unmaps the ring, the producer also removes the name
+    ~FrameRing();
+
+    // the producer's side, name is a shared memory object name such as "/tinyrenderer", replaced if it exists
+    bool create(const std::string &name, int width, int height, int bytespp, int slots);
+
+    // the consumer's side
+    bool open(const std::string &name);
+
+    // copies the frame into the next slot, false when its size is not the ring's or when no slot was released for
+    // 30 s, the consumer is then taken for dead
+    bool push(TGAImage &frame);
+
+    // no frame after this one, the consumer's next() returns nullptr once it has read the others
+    void close();
+
+    // the producer waits until the consumer has released every frame, false when it hasn't within 30 s
+    bool drain();
+
+    // waits for the next frame and points at its pixels, valid until release()
+    const unsigned char *next();
+
+    void release();
+
+    int width() const;
+
+    int height() const;
+
+    int bytespp() const;
+
+private:
+    struct Header {
+        uint32_t magic;
+        int32_t width, height, bytespp, slots;
+        uint64_t frame_bytes;
+        sem_t free;   // slots the producer can fill
+        sem_t filled; // frames the consumer can read, one more once closed
+        uint64_t written;
+        int32_t closed;
+    };
+
+    Header *header = nullptr;
+    size_t size = 0;
+    std::string name;
+    bool owner = false;
+    uint64_t read = 0; // the consumer's next frame
+
+    unsigned char *slot(uint64_t frame) const;
+};
+
+// frames into a FrameRing created on the first one, every frame must have its size
+class ShmRingSink : public FrameSink {
+public:
+    explicit ShmRingSink(const std::string &name, int slots = 3) : name(name), slots(slots) {}
+
+    // the consumer sees the end of the stream, waits until it has read every frame, 30 s at most
+    ~ShmRingSink() override;
+
+    bool write(TGAImage &frame, const std::string &name) override;
+
+private:
+    std::string name;
+    int slots;
+    bool created = false;
+    FrameRing ring;
+};
+
+// the rows of a frame stored bottom up, written top down to fd with writev(), retried until all is written
+bool write_rows_top_down(int fd, const unsigned char *pixels, int width, int height, int bytespp,
+                         std::vector<iovec> &rows);
@@ -0,0 +1,91 @@
+#include <iostream>
+#include "framewriter.h"
+#include "trace.h"
+
+FrameWriter::FrameWriter(int depth, bool rle) : FrameWriter(std::unique_ptr<FrameSink>(new TgaFileSink(rle)), depth) {}
+
+FrameWriter::FrameWriter(std::unique_ptr<FrameSink> sink, int depth) : sink(std::move(sink)), depth(depth), failed(false),
+                                                                       stopping(false), writing(false), mutex(),
+                                                                       changed(), queue(), free(), encoder() {
+    if (depth > 0) encoder = std::thread(&FrameWriter::run, this);
+}
+
+FrameWriter::~FrameWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    if (encoder.joinable()) encoder.join();
+}
+
+std::unique_ptr<TGAImage> FrameWriter::acquire(int width, int height, int bytespp) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < free.size(); i++) {
+            TGAImage &img = *free[i];
+            if (img.get_width() != width || img.get_height() != height || img.get_bytespp() != bytespp) continue;
+            std::unique_ptr<TGAImage> frame = std::move(free[i]);
+            free.erase(free.begin() + i);
+            frame->clear();
+            return frame;
+        }
+    }
+    return std::unique_ptr<TGAImage>(new TGAImage(width, height, bytespp));
+}
+
+void FrameWriter::submit(std::unique_ptr<TGAImage> frame, const std::string &filename) {
+    Frame f = {std::move(frame), filename};
+    if (depth <= 0) {
+        bool ok = write(f);
+        std::lock_guard<std::mutex> lock(mutex);
+        failed = failed || !ok;
+        recycle(std::move(f.image));
+        return;
+    }
+    TRACE_SCOPE("frame submit"); // waiting for the encoder shows up here
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return (int) queue.size() < depth; });
+    queue.push_back(std::move(f));
+    changed.notify_all();
+}
+
+bool FrameWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return queue.empty() && !writing; });
+    bool ok = !failed;
+    failed = false;
+    return ok;
+}
+
+bool FrameWriter::write(Frame &frame) {
+    TRACE_SCOPE("frame write");
+    if (sink->write(*frame.image, frame.filename)) return true;
+    std::cerr << "can't write frame " << frame.filename << std::endl;
+    return false;
+}
+
+// with the lock held, keeps no more buffers than can be in flight at once
+void FrameWriter::recycle(std::unique_ptr<TGAImage> frame) {
+    free.push_back(std::move(frame));
+    if ((int) free.size() > depth + 2) free.erase(free.begin());
+}
+
+void FrameWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        changed.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) return; // stopping, and everything is written
+        Frame frame = std::move(queue.front());
+        queue.pop_front();
+        writing = true;
+        changed.notify_all(); // a slot in the queue is free
+        lock.unlock();
+        bool ok = write(frame);
+        lock.lock();
+        writing = false;
+        failed = failed || !ok;
+        recycle(std::move(frame.image));
+        changed.notify_all();
+    }
+}
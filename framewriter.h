@@ -0,0 +1,57 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "framesink.h"
+#include "tgaimage.h"
+
+// Encodes and writes finished frames on a background thread, so the next frame renders meanwhile.
+// Frames go to the sink as they are rendered (first row at the bottom), there is no flip pass.
+// Up to depth frames wait for the encoder, submit() blocks when the queue is full. With depth 0 submit()
+// writes the frame itself. Written framebuffers are handed out again by acquire().
+class FrameWriter {
+public:
+    // TGA files, see TgaFileSink
+    explicit FrameWriter(int depth = 2, bool rle = true);
+
+    explicit FrameWriter(std::unique_ptr<FrameSink> sink, int depth = 2);
+
+    // writes everything still queued
+    ~FrameWriter();
+
+    // a cleared framebuffer
+    std::unique_ptr<TGAImage> acquire(int width, int height, int bytespp);
+
+    void submit(std::unique_ptr<TGAImage> frame, const std::string &filename);
+
+    // waits until every submitted frame is written, false if any write failed since the last flush
+    bool flush();
+
+private:
+    struct Frame {
+        std::unique_ptr<TGAImage> image;
+        std::string filename;
+    };
+
+    std::unique_ptr<FrameSink> sink;
+    int depth;
+    bool failed;
+    bool stopping;
+    bool writing;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Frame> queue;
+    std::vector<std::unique_ptr<TGAImage> > free;
+    std::thread encoder;
+
+    bool write(Frame &frame);
+
+    void recycle(std::unique_ptr<TGAImage> frame);
+
+    void run();
+};
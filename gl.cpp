@@ -1,7 +1,9 @@
+#include <algorithm>
 #include <cmath>
 #include <limits>
 #include <cstdlib>
 #include "gl.h"
+#include "trace.h"
 
 namespace {
     Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P) {
@@ -25,31 +27,279 @@ namespace {
         return z;
     }
 
-    // https://zhuanlan.zhihu.com/p/50141767
-    float perspective_interpolate_z(const std::vector<Vec3f> &screen_coords, Vec3f &c) {
-        float z = 0.f;
-        for (int i = 0; i < 3; ++i) {
-            z += c[i] / screen_coords[i].z;
+    // a * x + b * y + c
+    struct Plane {
+        float a, b, c;
+
+        float at(float x, float y) const {
+            return a * x + b * y + c;
         }
-        z = 1 / z;
+    };
 
-        for (int i = 0; i < 3; ++i) {
-            c[i] *= z / screen_coords[i].z;
+    // Everything interpolated across a triangle is set up once as a screen space plane and stepped with adds.
+    // e[i] is the linear barycentric coordinate of vertex i divided by its z, so that at every pixel
+    // z = 1 / (e0 + e1 + e2) and the perspective correct barycentric coordinates are bar[i] = e[i] * z,
+    // and every varying is v = z * sum(e[i] * varying[i]).
+    struct TriangleSetup {
+        Plane e[3];
+        Plane v[IShader::MAX_VARYINGS];
+        int nvaryings;
+
+        bool init(const std::vector<Vec3f> &pts, IShader *shader, int n) {
+            const Vec3f &A = pts[0], &B = pts[1], &C = pts[2];
+            float den = (B.y - C.y) * (A.x - C.x) + (C.x - B.x) * (A.y - C.y);
+            if (den == 0.f) return false;
+            Plane lin[3];
+            lin[0] = {(B.y - C.y) / den, (C.x - B.x) / den, 0};
+            lin[1] = {(C.y - A.y) / den, (A.x - C.x) / den, 0};
+            lin[0].c = -(lin[0].a * C.x + lin[0].b * C.y);
+            lin[1].c = -(lin[1].a * C.x + lin[1].b * C.y);
+            lin[2] = {-lin[0].a - lin[1].a, -lin[0].b - lin[1].b, 1 - lin[0].c - lin[1].c};
+            for (int i = 0; i < 3; i++) {
+                e[i] = {lin[i].a / pts[i].z, lin[i].b / pts[i].z, lin[i].c / pts[i].z};
+            }
+            nvaryings = n;
+            for (int k = 0; k < n; k++) {
+                const float v0 = shader->varyings[0][k], v1 = shader->varyings[1][k], v2 = shader->varyings[2][k];
+                v[k] = {e[0].a * v0 + e[1].a * v1 + e[2].a * v2,
+                        e[0].b * v0 + e[1].b * v1 + e[2].b * v2,
+                        e[0].c * v0 + e[1].c * v1 + e[2].c * v2};
+            }
+            return true;
         }
+    };
 
-        return z;
+    // Shades Packet::WIDTH x Packet::HEIGHT pixels at a time from the lower left corner of the bounding box.
+    // Coverage and depth are stepped one pixel at a time, as in a scanline loop, so a z prepass matches exactly. The
+    // varyings are only evaluated for the pixels of a packet on the triangle.
+    // The rows start at the target, the columns are stepped from x0 even left of it, see GL::glRegion().
+    // Depth is the zbuffer's format, see DepthBuffer.
+    template<typename Depth>
+    void shade_triangle(GL &ctx, const TriangleSetup &setup, int x0, int y0, float r, float t, bool colored) {
+        const int n = setup.nvaryings, ox = ctx.originX, oy = ctx.originY;
+        r = std::min(r, ox + ctx.width - 1.f);
+        t = std::min(t, oy + ctx.height - 1.f);
+        unsigned char *depth = ctx.zbuffer.pixel(0);
+        const TGAColor white = {255, 255, 255, 255};
+        Packet p;
+        TGAColor colors[Packet::SIZE];
+        float z[Packet::SIZE], el[3][Packet::SIZE];
+        float e[Packet::HEIGHT][3];
+        for (int y = std::max(y0, oy); y <= t; y += Packet::HEIGHT) {
+            for (int dy = 0; dy < Packet::HEIGHT; dy++) {
+                for (int i = 0; i < 3; i++) e[dy][i] = setup.e[i].at(x0, y + dy);
+            }
+            for (int x = x0; x <= r; x += Packet::WIDTH) {
+                int mask = 0, inside = 0;
+                for (int dy = 0, lane = 0; dy < Packet::HEIGHT; dy++) {
+                    float *ei = e[dy];
+                    for (int dx = 0; dx < Packet::WIDTH; dx++, lane++) {
+                        for (int i = 0; i < 3; i++) el[i][lane] = ei[i];
+                        if (x + dx >= ox && x + dx <= r && y + dy <= t && ei[0] >= 0 && ei[1] >= 0 && ei[2] >= 0) {
+                            inside |= 1 << lane;
+                            z[lane] = 1.f / (ei[0] + ei[1] + ei[2]);
+                            const int i = x + dx - ox + (y + dy - oy) * ctx.width;
+                            if ((!ctx.ids || ctx.ids[i] == ctx.primitive) &&
+                                ctx.depthTestFunc(Depth::load(depth + i * Depth::BYTES), Depth::quantize(z[lane]))) {
+                                mask |= 1 << lane;
+                            }
+                        }
+                        for (int i = 0; i < 3; i++) ei[i] += setup.e[i].a;
+                    }
+                }
+                if (!mask) continue;
+                // the varyings only where they are needed, from their planes
+                int first = -1;
+                for (int lane = 0; lane < Packet::SIZE; lane++) {
+                    if (!(inside >> lane & 1)) continue;
+                    if (first < 0) first = lane;
+                    const float px = x + lane % Packet::WIDTH, py = y + lane / Packet::WIDTH;
+                    for (int i = 0; i < 3; i++) p.bar[i][lane] = el[i][lane] * z[lane];
+                    for (int k = 0; k < n; k++) p.varying[k][lane] = setup.v[k].at(px, py) * z[lane];
+                }
+                // off the triangle z can be infinite or negative, those lanes take the values of a lane inside
+                for (int lane = 0; lane < Packet::SIZE; lane++) {
+                    if (inside >> lane & 1) continue;
+                    for (int i = 0; i < 3; i++) p.bar[i][lane] = p.bar[i][first];
+                    for (int k = 0; k < n; k++) p.varying[k][lane] = p.varying[k][first];
+                }
+                p.x = x;
+                p.y = y;
+                p.rate = 1;
+                p.mask = mask;
+                mask &= ~ctx.shader->fragment(p, colors);
+                for (int lane = 0; lane < Packet::SIZE; lane++) {
+                    if (!(mask >> lane & 1)) continue;
+                    int px = x + lane % Packet::WIDTH - ox, py = y + lane / Packet::WIDTH - oy;
+                    Depth::store(depth + (px + py * ctx.width) * Depth::BYTES, z[lane]);
+                    ctx.framebuffer->set(px, py, colored ? colors[lane] : white);
+                }
+            }
+        }
+    }
+
+    // One fragment() per block of rate x rate pixels, the blocks are aligned on the screen and a packet shades 4x2
+    // of them. Coverage and depth are stepped per pixel as in shade_triangle(), so a z prepass still matches. The
+    // blocks on the edges of the target are scanned whole, the pixel they are shaded at stays the frame's.
+    template<typename Depth>
+    void shade_triangle_coarse(GL &ctx, const TriangleSetup &setup, int x0, int y0, float r, float t, bool colored,
+                               int rate) {
+        const int n = setup.nvaryings, w = Packet::WIDTH * rate, h = Packet::HEIGHT * rate;
+        const int ox = ctx.originX, oy = ctx.originY, ys = std::max(y0, oy);
+        const float right = std::min(r, ox + ctx.width - 1.f), top = std::min(t, oy + ctx.height - 1.f);
+        unsigned char *zbuffer = ctx.zbuffer.pixel(0);
+        const TGAColor white = {255, 255, 255, 255};
+        Packet p;
+        TGAColor colors[Packet::SIZE];
+        float z[Packet::SIZE][16];      // of the pixels of each block
+        int covered[Packet::SIZE];      // bit j: the pixel (j % rate, j / rate) of the block is drawn
+        int inside[Packet::SIZE];       // the first pixel of the block inside the triangle, j as above, or -1
+        float e[4 * Packet::HEIGHT][3]; // of every row, stepped from x0
+        for (int y = ys - ys % rate; y <= top; y += h) {
+            for (int dy = 0; dy < h; dy++) {
+                for (int i = 0; i < 3; i++) e[dy][i] = setup.e[i].at(x0, y + dy);
+            }
+            for (int x = x0 - x0 % rate; x <= right; x += w) {
+                int mask = 0;
+                std::fill_n(covered, Packet::SIZE, 0);
+                std::fill_n(inside, Packet::SIZE, -1);
+                for (int dy = std::max(0, y0 - y); dy < h && y + dy <= t; dy++) {
+                    float *ei = e[dy];
+                    for (int dx = std::max(0, x0 - x); dx < w && x + dx <= r; dx++) {
+                        if (ei[0] >= 0 && ei[1] >= 0 && ei[2] >= 0) {
+                            int lane = dx / rate + dy / rate * Packet::WIDTH, j = dx % rate + dy % rate * rate;
+                            if (inside[lane] < 0) inside[lane] = j; // whatever the depth test, as without a z prepass
+                            const int px = x + dx, py = y + dy;
+                            if (px >= ox && py >= oy && px <= right && py <= top) {
+                                float depth = 1.f / (ei[0] + ei[1] + ei[2]);
+                                const int i = px - ox + (py - oy) * ctx.width;
+                                if ((!ctx.ids || ctx.ids[i] == ctx.primitive) &&
+                                    ctx.depthTestFunc(Depth::load(zbuffer + i * Depth::BYTES), Depth::quantize(depth))) {
+                                    z[lane][j] = depth;
+                                    covered[lane] |= 1 << j;
+                                    mask |= 1 << lane;
+                                }
+                            }
+                        }
+                        for (int i = 0; i < 3; i++) ei[i] += setup.e[i].a;
+                    }
+                }
+                if (!mask) continue;
+                // Off the triangle z can be infinite or negative. A block whose center is off it is shaded at one of
+                // its pixels inside, the blocks not drawn take the values of one that is.
+                int first = -1;
+                for (int lane = 0; lane < Packet::SIZE; lane++) {
+                    if (!(mask >> lane & 1)) continue;
+                    if (first < 0) first = lane;
+                    float cx = x + lane % Packet::WIDTH * rate + (rate - 1) * .5f;
+                    float cy = y + lane / Packet::WIDTH * rate + (rate - 1) * .5f;
+                    float el[3];
+                    for (int i = 0; i < 3; i++) el[i] = setup.e[i].at(cx, cy);
+                    if (!(el[0] >= 0 && el[1] >= 0 && el[2] >= 0)) {
+                        cx = x + lane % Packet::WIDTH * rate + inside[lane] % rate;
+                        cy = y + lane / Packet::WIDTH * rate + inside[lane] / rate;
+                        for (int i = 0; i < 3; i++) el[i] = setup.e[i].at(cx, cy);
+                    }
+                    float zc = 1.f / (el[0] + el[1] + el[2]);
+                    for (int i = 0; i < 3; i++) p.bar[i][lane] = el[i] * zc;
+                    for (int k = 0; k < n; k++) p.varying[k][lane] = setup.v[k].at(cx, cy) * zc;
+                }
+                for (int lane = 0; lane < Packet::SIZE; lane++) {
+                    if (mask >> lane & 1) continue;
+                    for (int i = 0; i < 3; i++) p.bar[i][lane] = p.bar[i][first];
+                    for (int k = 0; k < n; k++) p.varying[k][lane] = p.varying[k][first];
+                }
+                p.x = x;
+                p.y = y;
+                p.rate = rate;
+                p.mask = mask;
+                mask &= ~ctx.shader->fragment(p, colors);
+                for (int lane = 0; lane < Packet::SIZE; lane++) {
+                    if (!(mask >> lane & 1)) continue;
+                    int bx = x + lane % Packet::WIDTH * rate, by = y + lane / Packet::WIDTH * rate;
+                    for (int j = 0; j < rate * rate; j++) {
+                        if (!(covered[lane] >> j & 1)) continue;
+                        int px = bx + j % rate - ox, py = by + j / rate - oy;
+                        Depth::store(zbuffer + (px + py * ctx.width) * Depth::BYTES, z[lane][j]);
+                        ctx.framebuffer->set(px, py, colored ? colors[lane] : white);
+                    }
+                }
+            }
+        }
+    }
+
+    // the coarsest rate at which a block spans at most shadingDetail texels, from the texel and pixel areas
+    int auto_rate(GL &ctx, const std::vector<Vec3f> &pts) {
+        Vec2f texels;
+        const int u = ctx.shader->texcoords(texels);
+        if (u < 0) return 1;
+        const float (*v)[IShader::MAX_VARYINGS] = ctx.shader->varyings;
+        float uv_area = std::abs((v[1][u] - v[0][u]) * (v[2][u + 1] - v[0][u + 1]) -
+                                 (v[2][u] - v[0][u]) * (v[1][u + 1] - v[0][u + 1])) * texels.x * texels.y;
+        float area = std::abs((pts[1].x - pts[0].x) * (pts[2].y - pts[0].y) - (pts[2].x - pts[0].x) * (pts[1].y - pts[0].y));
+        float density = std::sqrt(uv_area / area); // texels per pixel side
+        int rate = GL::SHADING_4X4;
+        while (rate > 1 && rate * density > ctx.shadingDetail) rate /= 2;
+        return rate;
     }
 
-    // https://codeplea.com/triangular-interpolation
-    Vec3f barycentric2(Vec2f A, Vec2f B, Vec2f C, Vec2f P) {
-        float u, v;
-        u = ((B.y - C.y) * (P.x - C.x) + (C.x - B.x) * (P.y - C.y)) /
-            ((B.y - C.y) * (A.x - C.x) + (C.x - B.x) * (A.y - C.y));
-        v = ((C.y - A.y) * (P.x - C.x) + (A.x - C.x) * (P.y - C.y)) /
-            ((B.y - C.y) * (A.x - C.x) + (C.x - B.x) * (A.y - C.y));
-        return {u, v, 1 - u - v};
+    template<bool shade, typename Depth>
+    void raster(GL &ctx, const TriangleSetup &setup, int x0, int y0, float r, float t, bool colored, int rate) {
+        if (shade && rate > 1) {
+            shade_triangle_coarse<Depth>(ctx, setup, x0, y0, r, t, colored, rate);
+            return;
+        }
+        if (shade) {
+            shade_triangle<Depth>(ctx, setup, x0, y0, r, t, colored);
+            return;
+        }
+        const int ox = ctx.originX, oy = ctx.originY;
+        r = std::min(r, ox + ctx.width - 1.f);
+        t = std::min(t, oy + ctx.height - 1.f);
+        unsigned char *depth = ctx.zbuffer.pixel(0);
+        float e[3];
+        for (int y = std::max(y0, oy); y <= t; y++) {
+            for (int i = 0; i < 3; i++) e[i] = setup.e[i].at(x0, y);
+            for (int x = x0; x <= r; x++) {
+                if (x >= ox && e[0] >= 0 && e[1] >= 0 && e[2] >= 0) {
+                    float z = 1.f / (e[0] + e[1] + e[2]);
+                    const int i = x - ox + (y - oy) * ctx.width;
+                    unsigned char *o = depth + i * Depth::BYTES;
+                    if (ctx.depthTestFunc(Depth::load(o), Depth::quantize(z))) {
+                        Depth::store(o, z);
+                        if (ctx.ids) ctx.ids[i] = ctx.primitive;
+                    }
+                }
+                for (int i = 0; i < 3; i++) e[i] += setup.e[i].a;
+            }
+        }
+    }
+
+    // The pixels from (x0, y0) to (r, t) of a triangle, in frame coordinates: only those on the target are written,
+    // see GL::glRegion(). Without shading only the zbuffer is written.
+    template<bool shade>
+    void raster(GL &ctx, const TriangleSetup &setup, int x0, int y0, float r, float t, bool colored, int rate) {
+        const int xs = std::max(x0, ctx.originX), ys = std::max(y0, ctx.originY);
+        const float rs = std::min(r, ctx.originX + ctx.width - 1.f), ts = std::min(t, ctx.originY + ctx.height - 1.f);
+        if (rs < xs || ts < ys) return;
+        ctx.zbuffer.touch(xs - ctx.originX, ys - ctx.originY, static_cast<int>(rs) - ctx.originX,
+                          static_cast<int>(ts) - ctx.originY);
+        switch (ctx.zbuffer.format()) {
+            case DepthBuffer::FLOAT32:
+                raster<shade, DepthFloat32>(ctx, setup, x0, y0, r, t, colored, rate);
+                break;
+            case DepthBuffer::UNORM24:
+                raster<shade, DepthUnorm24>(ctx, setup, x0, y0, r, t, colored, rate);
+                break;
+            case DepthBuffer::UNORM16:
+                raster<shade, DepthUnorm16>(ctx, setup, x0, y0, r, t, colored, rate);
+                break;
+        }
     }
 
+    // in retained mode only the dirty tiles of the bounding box are rasterized, with tile shading rates every tile
+    // at its own rate
+    template<bool shade>
     void triangle(GL &ctx, const std::vector<Vec3f> &screen_coords, bool colored) {
         auto MAX = std::numeric_limits<float>::max();
         float l, t, r, b;
@@ -61,80 +311,437 @@ namespace {
             t = std::max(t, pt.y);
             b = std::min(b, pt.y);
         }
+        // the bounding box in the frame, so that a region steps from the same pixel as the whole frame
+        l = std::max(l, 0.f);
+        b = std::max(b, 0.f);
+        r = std::min(r, ctx.frameWidth - 1.f);
+        t = std::min(t, ctx.frameHeight - 1.f);
 
-        Vec2i P;
-        float z;
-        int index;
-        TGAColor color;
-        const TGAColor white = {255, 255, 255, 255};
-        for (P.x = static_cast<int>(l); P.x <= r; P.x++) {
-            for (P.y = static_cast<int>(b); P.y <= t; P.y++) {
-                Vec3f c = barycentric2(proj<2>(screen_coords[0]),
-                                       proj<2>(screen_coords[1]),
-                                       proj<2>(screen_coords[2]),
-                                       P);
-                z = perspective_interpolate_z(screen_coords, c);
-                index = P.x + P.y * ctx.framebuffer->get_width();
-                if (c.x < 0 || c.y < 0 || c.z < 0 || !ctx.depthTestFunc(ctx.zbuffer[index], z)) continue;
-                bool discard = ctx.shader->fragment(c, color);
-                if (!discard) {
-                    ctx.zbuffer[P.x + P.y * ctx.framebuffer->get_width()] = z;
-                    ctx.framebuffer->set(P.x, P.y, colored ? color : white);
-                }
+        if (ctx.retained) {
+            TileRect tiles = ctx.screenTiles(screen_coords);
+            ctx.drawnTiles.add(tiles);
+            if (!ctx.glDirty(tiles)) return;
+        }
+
+        TriangleSetup setup;
+        if (!setup.init(screen_coords, ctx.shader, shade ? ctx.shader->nvaryings() : 0)) return; // degenerate
+
+        const int x0 = static_cast<int>(l), y0 = static_cast<int>(b);
+        const int rate = !shade ? 1 : ctx.shadingRate == GL::SHADING_AUTO ? auto_rate(ctx, screen_coords) : ctx.shadingRate;
+        if (!ctx.retained && ctx.tileRates.empty()) {
+            raster<shade>(ctx, setup, x0, y0, r, t, colored, rate);
+            return;
+        }
+        // tile by tile, so that a tile comes out the same whether the whole screen is drawn or only this tile
+        const int ox = ctx.originX, oy = ctx.originY;
+        for (int ty = std::max(y0 - oy, 0) / GL::TILE; ty < ctx.tilesY && oy + ty * GL::TILE <= t; ty++) {
+            for (int tx = std::max(x0 - ox, 0) / GL::TILE; tx < ctx.tilesX && ox + tx * GL::TILE <= r; tx++) {
+                if (ctx.retained && !ctx.dirtyTiles[tx + ty * ctx.tilesX]) continue;
+                int tile_rate = ctx.tileRates.empty() ? rate : std::max<int>(rate, ctx.tileRates[tx + ty * ctx.tilesX]);
+                const int tile_x = ox + tx * GL::TILE, tile_y = oy + ty * GL::TILE;
+                raster<shade>(ctx, setup, std::max(x0, tile_x), std::max(y0, tile_y),
+                              std::min(r, tile_x + GL::TILE - 1.f), std::min(t, tile_y + GL::TILE - 1.f),
+                              colored, tile_rate);
+            }
+        }
+    }
+}
+
+namespace {
+    // Gribb/Hartmann: the clip space planes -w <= x, y, z <= w are rows of the mvp, inside when p * v >= 0
+    void frustum_planes(const Matrix &mvp, Vec4f planes[6]) {
+        for (int i = 0; i < 3; i++) {
+            planes[2 * i] = mvp[3] + mvp[i];
+            planes[2 * i + 1] = mvp[3] - mvp[i];
+        }
+    }
+}
+
+bool outside_frustum(const Matrix &mvp, const Vec3f &lo, const Vec3f &hi) {
+    Vec4f planes[6];
+    frustum_planes(mvp, planes);
+    for (auto &p : planes) {
+        // the box corner furthest along the plane normal
+        Vec3f v(p[0] >= 0 ? hi.x : lo.x, p[1] >= 0 ? hi.y : lo.y, p[2] >= 0 ? hi.z : lo.z);
+        if (p * embed<4>(v) < 0) return true;
+    }
+    return false;
+}
+
+namespace {
+    const TGAColor white(255, 255, 255);
+
+    // the depth a triangle sharing this edge would get at t, see TriangleSetup
+    float edge_depth(float z0, float z1, float t) {
+        return 1.f / ((1.f - t) / z0 + t / z1);
+    }
+
+    // let the lines win the depth test against the faces they belong to
+    float line_depth_bias(const GL &ctx) {
+        return ctx.depthFunc == GL::LESS ? -1e-3f : 1e-3f;
+    }
+
+    bool outside_frustum(const Matrix &mvp, Model *model) {
+        Vec4f planes[6];
+        frustum_planes(mvp, planes);
+        Vec4f c = embed<4>(model->center());
+        for (auto &p : planes) {
+            if (p * c < -model->radius() * proj<3>(p).norm()) return true;
+        }
+        return ::outside_frustum(mvp, model->bbox_min(), model->bbox_max());
+    }
+
+    template<typename Depth>
+    bool test_and_write(GL &ctx, unsigned char *o, float z, float bias) {
+        if (!ctx.depthTestFunc(Depth::load(o), Depth::quantize(z + bias))) return false;
+        Depth::store(o, z);
+        return true;
+    }
+
+    // the depth test of points and lines, z is written when it passes
+    bool depth_test(GL &ctx, int x, int y, float z) {
+        ctx.zbuffer.touch(x, y, x, y);
+        unsigned char *o = ctx.zbuffer.pixel(x + y * ctx.width);
+        switch (ctx.zbuffer.format()) {
+            case DepthBuffer::UNORM24:
+                return test_and_write<DepthUnorm24>(ctx, o, z, line_depth_bias(ctx));
+            case DepthBuffer::UNORM16:
+                return test_and_write<DepthUnorm16>(ctx, o, z, line_depth_bias(ctx));
+            default:
+                return test_and_write<DepthFloat32>(ctx, o, z, line_depth_bias(ctx));
+        }
+    }
+
+    // x, y in frame coordinates
+    void plot(GL &ctx, int x, int y, float z) {
+        x -= ctx.originX;
+        y -= ctx.originY;
+        if (x < 0 || y < 0 || x >= ctx.width || y >= ctx.height) return;
+        if (ctx.retained) {
+            TileRect tile = {x / GL::TILE, y / GL::TILE, x / GL::TILE, y / GL::TILE};
+            ctx.drawnTiles.add(tile);
+            if (!ctx.dirtyTiles[tile.x0 + tile.y0 * ctx.tilesX]) return;
+        }
+        if (ctx.lineDepthTest && !depth_test(ctx, x, y, z)) return;
+        ctx.framebuffer->set(x, y, white);
+    }
+
+    // integer Bresenham, every pixel of the segment is written exactly once
+    void line(GL &ctx, const Vec3f &a, const Vec3f &b) {
+        Vec2i p0 = proj<2>(a), p1 = proj<2>(b);
+        int dx = std::abs(p1.x - p0.x), sx = p0.x < p1.x ? 1 : -1;
+        int dy = -std::abs(p1.y - p0.y), sy = p0.y < p1.y ? 1 : -1;
+        int steps = std::max(dx, -dy), err = dx + dy;
+        for (int k = 0;; k++) {
+            plot(ctx, p0.x, p0.y, ctx.lineDepthTest && steps ? edge_depth(a.z, b.z, float(k) / steps) : a.z);
+            if (p0.x == p1.x && p0.y == p1.y) break;
+            int e2 = 2 * err;
+            if (e2 >= dy) {
+                err += dy;
+                p0.x += sx;
+            }
+            if (e2 <= dx) {
+                err += dx;
+                p0.y += sy;
             }
         }
     }
 }
 
 void GL::glDraw() {
-    std::vector<Vec3f> screen_coords(3);
+    if (zPrepass && (rendererType == TRIANGLE || rendererType == TRIANGLE_COLORED)) {
+        deferred.push_back({shader, nullptr, 0, nullptr, 0, shadingRate, shadingDetail});
+        return;
+    }
+    TRACE_SCOPE("draw");
     Vec4f v;
     Model *model = shader->get_model();
-    for (int i = 0; i < model->nfaces(); i++) {
-        screen_coords.clear();
+    if (frustumCulling && shader->has_mvp() && outside_frustum(shader->get_mvp(), model)) {
+        culledDraws++;
+        return;
+    }
+    visibleDraws++;
+    if (rendererType == VERTEX || rendererType == LINE) {
+        drawWireframe(model);
+        return;
+    }
+    Vec2i faces = model->lod(selectLod(model));
+    bool depth_only = rendererType == DEPTH;
+    // in retained mode the faces outside of the dirty tiles don't need the varyings
+    bool positions_first = retained && !depth_only;
+    for (int i = faces.x; i < faces.y; i++) {
+        primitive++;
         for (int j = 0; j < 3; j++) {
-            v = shader->vertex(i, j);
+            v = depth_only || positions_first ? shader->position(i, j) : shader->vertex(i, j);
             v = v / v[3];
             v = viewportMat * v;
-            screen_coords.emplace_back(proj<3>(v));
+            screen_coords[j] = proj<3>(v);
+        }
+        if (positions_first) {
+            TileRect tiles = screenTiles(screen_coords);
+            drawnTiles.add(tiles);
+            if (!glDirty(tiles)) continue;
+            for (int j = 0; j < 3; j++) shader->vertex(i, j);
         }
         interpolator(*this, screen_coords);
     }
 }
 
-void line_interpolator(GL &context, const std::vector<Vec3f> &screen_coords) {
-    const TGAColor white(255, 255, 255);
-    const int len = 100;
-    const float step = 1.f / len;
-    int k;
-    float t;
-    Vec2i v0, v1;
-    for (size_t i = 0, j = 0; i < screen_coords.size(); ++i) {
-        j = (i + 1) % screen_coords.size();
-        v0 = proj<2>(screen_coords[i]);
-        v1 = proj<2>(screen_coords[j]);
-        k = 0;
-        t = 0.f;
-        while (k++ < len) {
-            context.framebuffer->set(static_cast<int>(v0.x + (v1.x - v0.x) * t),
-                                     static_cast<int>(v0.y + (v1.y - v0.y) * t),
-                                     white);
-            t += step;
-        }
-    }
-}
-
-void points_interpolator(GL &context, const std::vector<Vec3f> &screen_coords) {
-    const TGAColor white(255, 255, 255);
-    for (auto &pt : screen_coords) {
-        context.framebuffer->set(static_cast<int>(pt[0]), static_cast<int>(pt[1]), white);
+// of the bounding box of a triangle, clamped to the target
+TileRect GL::screenTiles(const std::vector<Vec3f> &pts) const {
+    float l = std::max(0.f, std::min(pts[0].x, std::min(pts[1].x, pts[2].x)) - originX);
+    float b = std::max(0.f, std::min(pts[0].y, std::min(pts[1].y, pts[2].y)) - originY);
+    float r = std::min(width - 1.f, std::max(pts[0].x, std::max(pts[1].x, pts[2].x)) - originX);
+    float t = std::min(height - 1.f, std::max(pts[0].y, std::max(pts[1].y, pts[2].y)) - originY);
+    if (r < static_cast<int>(l) || t < static_cast<int>(b)) return TileRect();
+    TileRect tiles = {static_cast<int>(l) / TILE, static_cast<int>(b) / TILE, static_cast<int>(r) / TILE,
+                      static_cast<int>(t) / TILE};
+    return tiles;
+}
+
+void GL::glDrawInstanced(const Matrix *transforms, int count, const float *params, int nparams) {
+    if (zPrepass && (rendererType == TRIANGLE || rendererType == TRIANGLE_COLORED)) {
+        deferred.push_back({shader, transforms, count, params, nparams, shadingRate, shadingDetail});
+        return;
+    }
+    TRACE_SCOPE("instanced draw");
+    Model *model = shader->get_model();
+    Matrix mvp = shader->get_mvp();
+    bool cull = frustumCulling && shader->has_mvp();
+    instances.clear();
+    for (int i = 0; i < count; i++) {
+        Instance instance = {i, mvp * transforms[i]};
+        if (cull && outside_frustum(instance.mvp, model)) {
+            culledDraws++;
+            continue;
+        }
+        visibleDraws++;
+        instances.push_back(instance);
+    }
+    for (auto &instance : instances) {
+        shader->set_mvp(instance.mvp);
+        shader->set_instance(transforms[instance.index], params ? params + instance.index * nparams : nullptr,
+                             nparams);
+        if (rendererType == VERTEX || rendererType == LINE) {
+            drawWireframe(model);
+        } else {
+            drawInstance(model, instance.mvp);
+        }
+    }
+    shader->set_mvp(mvp);
+    shader->clear_instance();
+}
+
+// The vertices are transformed when a face first uses them, a face off the screen never reaches the vertex shader.
+// The varyings are not cached: they belong to the corners of a face, whose uvs and normals are not the vertex's.
+void GL::drawInstance(Model *model, const Matrix &mvp) {
+    if (vertex_stamps.size() < static_cast<size_t>(model->nverts()) || ++stamp == 0) {
+        vertex_stamps.assign(static_cast<size_t>(std::max(model->nverts(), (int) vertex_stamps.size())), 0);
+        stamp = 1;
+    }
+    vertex_coords.resize(std::max(vertex_coords.size(), static_cast<size_t>(model->nverts())));
+    Vec2i faces = model->lod(selectLod(model));
+    bool depth_only = rendererType == DEPTH;
+    for (int i = faces.x; i < faces.y; i++) {
+        primitive++;
+        Vec3i face = model->face(i);
+        for (int j = 0; j < 3; j++) {
+            int k = face[j];
+            if (vertex_stamps[k] != stamp) {
+                Vec4f v = mvp * embed<4>(model->vert(k));
+                v = v / v[3];
+                v = viewportMat * v;
+                vertex_coords[k] = proj<3>(v);
+                vertex_stamps[k] = stamp;
+            }
+            screen_coords[j] = vertex_coords[k];
+        }
+        float l = std::min(screen_coords[0].x, std::min(screen_coords[1].x, screen_coords[2].x));
+        float r = std::max(screen_coords[0].x, std::max(screen_coords[1].x, screen_coords[2].x));
+        float b = std::min(screen_coords[0].y, std::min(screen_coords[1].y, screen_coords[2].y));
+        float t = std::max(screen_coords[0].y, std::max(screen_coords[1].y, screen_coords[2].y));
+        if (r < originX || t < originY || l > originX + width - 1 || b > originY + height - 1) continue;
+        if (!depth_only) {
+            for (int j = 0; j < 3; j++) shader->vertex(i, j); // the varyings only
+        }
+        interpolator(*this, screen_coords);
+    }
+}
+
+void GL::glFlush() {
+    if (deferred.empty()) return;
+    IShader *current = shader;
+    RendererType type = rendererType;
+    DepthTestFunc test = depthTestFunc;
+    ShadingRate rate = shadingRate;
+    float detail = shadingDetail;
+    int visible = visibleDraws, culled = culledDraws;
+    zPrepass = false;
+    prepassIds.assign(static_cast<size_t>(width) * height, 0); // no triangle, they are counted from 1
+    ids = prepassIds.data();
+    primitive = 0;
+
+    glRenderer(DEPTH);
+    {
+        TRACE_SCOPE("depth prepass");
+        for (auto &draw : deferred) {
+            shader = draw.shader;
+            if (draw.transforms) {
+                glDrawInstanced(draw.transforms, draw.count, draw.params, draw.nparams);
+            } else {
+                glDraw();
+            }
+        }
+    }
+    visibleDraws = visible; // count every draw once
+    culledDraws = culled;
+
+    glRenderer(type);
+    depthTestFunc = depth_equal;
+    primitive = 0;
+    {
+        TRACE_SCOPE("shading pass");
+        for (auto &draw : deferred) {
+            shader = draw.shader;
+            glShadingRate(draw.rate, draw.detail);
+            if (draw.transforms) {
+                glDrawInstanced(draw.transforms, draw.count, draw.params, draw.nparams);
+            } else {
+                glDraw();
+            }
+        }
+    }
+
+    deferred.clear(); // keeps the memory for the next frame
+    ids = nullptr;
+    depthTestFunc = test;
+    glShadingRate(rate, detail);
+    zPrepass = true;
+    shader = current;
+}
+
+void GL::glRetained(bool enable) {
+    retained = enable;
+    dirtyTiles.assign(static_cast<size_t>(tilesX * tilesY), 1);
+    drawnTiles = TileRect();
+}
+
+void GL::glInvalidate(TileRect tiles) {
+    tiles.x0 = std::max(tiles.x0, 0), tiles.y0 = std::max(tiles.y0, 0);
+    tiles.x1 = std::min(tiles.x1, tilesX - 1), tiles.y1 = std::min(tiles.y1, tilesY - 1);
+    for (int y = tiles.y0; y <= tiles.y1; y++) {
+        for (int x = tiles.x0; x <= tiles.x1; x++) dirtyTiles[x + y * tilesX] = 1;
+    }
+}
+
+void GL::glTileShadingRate(TileRect tiles, ShadingRate rate) {
+    if (tileRates.empty()) tileRates.assign(static_cast<size_t>(tilesX * tilesY), SHADING_1X1);
+    tiles.x0 = std::max(tiles.x0, 0), tiles.y0 = std::max(tiles.y0, 0);
+    tiles.x1 = std::min(tiles.x1, tilesX - 1), tiles.y1 = std::min(tiles.y1, tilesY - 1);
+    for (int y = tiles.y0; y <= tiles.y1; y++) {
+        for (int x = tiles.x0; x <= tiles.x1; x++) tileRates[x + y * tilesX] = static_cast<unsigned char>(rate);
+    }
+}
+
+void GL::glValidate() {
+    std::fill(dirtyTiles.begin(), dirtyTiles.end(), 0);
+}
+
+bool GL::glDirty(TileRect tiles) const {
+    tiles.x0 = std::max(tiles.x0, 0), tiles.y0 = std::max(tiles.y0, 0);
+    tiles.x1 = std::min(tiles.x1, tilesX - 1), tiles.y1 = std::min(tiles.y1, tilesY - 1);
+    for (int y = tiles.y0; y <= tiles.y1; y++) {
+        for (int x = tiles.x0; x <= tiles.x1; x++) {
+            if (dirtyTiles[x + y * tilesX]) return true;
+        }
+    }
+    return false;
+}
+
+int GL::glDirtyCount() const {
+    return static_cast<int>(std::count(dirtyTiles.begin(), dirtyTiles.end(), 1));
+}
+
+void GL::glClearDirty() {
+    const int bytespp = framebuffer ? framebuffer->get_bytespp() : 0;
+    for (int ty = 0; ty < tilesY; ty++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            if (!dirtyTiles[tx + ty * tilesX]) continue;
+            zbuffer.clear_tile(tx, ty);
+            if (!bytespp) continue;
+            int x0 = tx * TILE, x1 = std::min(x0 + TILE, width);
+            for (int y = ty * TILE; y < std::min(ty * TILE + TILE, height); y++) {
+                std::fill_n(framebuffer->buffer() + (x0 + y * width) * bytespp, (x1 - x0) * bytespp, 0);
+            }
+        }
+    }
+}
+
+// the bounding box corners, all of the screen when one of them is behind the camera
+TileRect GL::glScreenTiles(const Matrix &mvp, Model *model) const {
+    TileRect all = {0, 0, tilesX - 1, tilesY - 1};
+    float l = MAXFLOAT, b = MAXFLOAT, r = -MAXFLOAT, t = -MAXFLOAT;
+    Vec3f lo = model->bbox_min(), hi = model->bbox_max();
+    for (int i = 0; i < 8; i++) {
+        Vec4f v = mvp * embed<4>(Vec3f(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z));
+        if (v[3] <= 0.f) return all;
+        v = viewportMat * (v / v[3]);
+        l = std::min(l, v[0] - originX), r = std::max(r, v[0] - originX);
+        b = std::min(b, v[1] - originY), t = std::max(t, v[1] - originY);
+    }
+    if (r < 0 || t < 0 || l > width - 1 || b > height - 1) return TileRect();
+    TileRect tiles = {static_cast<int>(std::max(l, 0.f)) / TILE, static_cast<int>(std::max(b, 0.f)) / TILE,
+                      static_cast<int>(std::min(r, width - 1.f)) / TILE, static_cast<int>(std::min(t, height - 1.f)) / TILE};
+    return tiles;
+}
+
+int GL::selectLod(Model *model) {
+    if (lodDensity <= 0.f || !shader->has_mvp() || model->nlods() < 2) return 0;
+    Matrix mvp = shader->get_mvp();
+    Vec4f c = mvp * embed<4>(model->center());
+    if (c[3] <= 0.f) return 0; // the camera is inside the bounding sphere
+    // the largest screen space stretch of the mvp, in pixels
+    float sx = proj<3>(mvp[0]).norm() * std::abs(viewportMat[0][0]);
+    float sy = proj<3>(mvp[1]).norm() * std::abs(viewportMat[1][1]);
+    float r = model->radius() * std::max(sx, sy) / c[3];
+    float budget = float(M_PI) * r * r / lodDensity;
+    int level = 0;
+    while (level + 1 < model->nlods() && model->lod(level).y - model->lod(level).x > budget) level++;
+    return level;
+}
+
+// every vertex goes through the vertex shader once, every edge shared by two faces is drawn once
+void GL::drawWireframe(Model *model) {
+    TRACE_SCOPE("vertex stage");
+    Vec4f v;
+    vertex_coords.resize(static_cast<size_t>(model->nverts()));
+    for (int i = 0; i < model->nverts(); i++) {
+        Vec2i c = model->corner(i);
+        if (c.x < 0) continue;
+        v = shader->vertex(c.x, c.y);
+        v = v / v[3];
+        v = viewportMat * v;
+        vertex_coords[i] = proj<3>(v);
+        if (rendererType == VERTEX) {
+            plot(*this, static_cast<int>(vertex_coords[i].x), static_cast<int>(vertex_coords[i].y), vertex_coords[i].z);
+        }
+    }
+    if (rendererType == LINE) {
+        TRACE_SCOPE("line raster");
+        for (auto &e : model->edges()) {
+            line(*this, vertex_coords[e.x], vertex_coords[e.y]);
+        }
     }
 }
 
 void triangle_interpolator(GL &context, const std::vector<Vec3f> &screen_coords) {
-    triangle(context, screen_coords, false);
+    triangle<true>(context, screen_coords, false);
 }
 
 void default_interpolator(GL &context, const std::vector<Vec3f> &screen_coords) {
-    triangle(context, screen_coords, true);
+    triangle<true>(context, screen_coords, true);
+}
+
+void depth_interpolator(GL &context, const std::vector<Vec3f> &screen_coords) {
+    triangle<false>(context, screen_coords, false);
 }
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <iostream>
 #include "tgaimage.h"
 #include "geometry.h"
 #include "model.h"
 #include "mat.h"
+#include "depthbuffer.h"
 
 class GL;
 
@@ -15,19 +19,66 @@ inline bool depth_more(float o, float n) {
     return n > 0.f && n < 1.f && n > o;
 }
 
-void points_interpolator(GL &context, const std::vector<Vec3f> &screen_coords);
+// the second pass of a depth prepass, only the fragments that won the first pass are shaded
+inline bool depth_equal(float o, float n) {
+    return n > 0.f && n < 1.f && n == o;
+}
 
-void line_interpolator(GL &context, const std::vector<Vec3f> &screen_coords);
+// true when the box from lo to hi is entirely outside of the view frustum of mvp
+bool outside_frustum(const Matrix &mvp, const Vec3f &lo, const Vec3f &hi);
 
 void triangle_interpolator(GL &context, const std::vector<Vec3f> &screen_coords);
 
 void default_interpolator(GL &context, const std::vector<Vec3f> &screen_coords);
 
+void depth_interpolator(GL &context, const std::vector<Vec3f> &screen_coords);
+
+struct Packet;
+
+// tiles (x0, y0) to (x1, y1) included, empty when x0 > x1
+struct TileRect {
+    int x0 = 0, y0 = 0, x1 = -1, y1 = -1;
+
+    bool empty() const {
+        return x0 > x1 || y0 > y1;
+    }
+
+    void add(const TileRect &r) {
+        if (r.empty()) return;
+        if (empty()) {
+            *this = r;
+            return;
+        }
+        x0 = std::min(x0, r.x0), y0 = std::min(y0, r.y0);
+        x1 = std::max(x1, r.x1), y1 = std::max(y1, r.y1);
+    }
+};
+
 struct IShader {
+    static const int MAX_VARYINGS = 16;
+
+    // A shader with nvaryings() > 0 writes that many floats per vertex to varyings[nthvert] in vertex().
+    // The rasterizer interpolates them (perspective correct) and calls fragment(const float *varying, ...)
+    // instead of fragment(Vec3f bar, ...).
+    float varyings[3][MAX_VARYINGS];
+
     virtual ~IShader() = default;
 
+    virtual int nvaryings() {
+        return 0;
+    }
+
     virtual void set_mvp(Matrix mvp) {}
 
+    virtual Matrix get_mvp() {
+        return Matrix::identity();
+    }
+
+    // whether get_mvp() is the transform vertex() applies: without it nothing is culled and level 0 is drawn
+    virtual bool has_mvp() {
+        return false;
+    }
+
     virtual void set_model(Model *model) {}
 
     virtual Model *get_model() {
@@ -36,35 +87,166 @@ struct IShader {
 
     virtual Vec4f vertex(int iface, int nthvert) = 0;
 
-    virtual bool fragment(Vec3f bar, TGAColor &color) = 0;
+    // the vertex stage of depth-only passes, clip coordinates without any varying
+    virtual Vec4f position(int iface, int nthvert) {
+        return vertex(iface, nthvert);
+    }
+
+    // Called by GL::glDrawInstanced() before the faces of an instance are drawn, with the instance transform (object
+    // to world) and its nparams parameters. The mvp is already set to the draw's mvp times the transform.
+    virtual void set_instance(const Matrix &, const float *, int) {}
+
+    // called by GL::glDrawInstanced() after its last instance, the shader draws as before set_instance() again
+    virtual void clear_instance() {}
+
+    // For GL::SHADING_AUTO: the index of the u varying of the texture the color mostly comes from, v is the next
+    // one, and the size of that texture in texels. -1 when there is none, the triangles are then shaded at 1x1.
+    virtual int texcoords(Vec2f &) {
+        return -1;
+    }
+
+    // override this one, or fragment(const float *, TGAColor &) together with nvaryings()
+    virtual bool fragment(Vec3f bar, TGAColor &color) {
+        float varying[MAX_VARYINGS];
+        for (int k = 0; k < nvaryings(); k++) {
+            varying[k] = varyings[0][k] * bar.x + varyings[1][k] * bar.y + varyings[2][k] * bar.z;
+        }
+        return fragment(varying, color);
+    }
+
+    virtual bool fragment(const float *, TGAColor &) {
+        assert(!"a shader overrides one of the two fragment() above");
+        return true;
+    }
+
+    // What the rasterizer calls: shades the lanes of packet.mask and returns the mask of the lanes to discard.
+    // This default shades them one pixel at a time with the fragment() above.
+    virtual int fragment(const Packet &packet, TGAColor color[]);
 };
 
+// 4x2 pixels shaded at once, two 2x2 quads side by side: lane i is the pixel (x + i % WIDTH, y + i / WIDTH),
+// each channel is stored lane by lane. Every lane holds values interpolated inside the triangle, the lanes off it
+// those of a lane on it, so that a shader can sample them all without checking the mask. At a coarse shading rate
+// a lane is the center of the block of rate x rate pixels from (x + i % WIDTH * rate, y + i / WIDTH * rate), or
+// a pixel of the block inside the triangle when the center is not.
+struct Packet {
+    static const int WIDTH = 4;
+    static const int HEIGHT = 2;
+    static const int SIZE = WIDTH * HEIGHT;
+
+    int x, y;
+    int rate;           // 1, 2 or 4, see GL::glShadingRate()
+    int mask;           // bit i: lane i is covered and passed the depth test
+    float bar[3][SIZE]; // perspective correct barycentric coordinates
+    float varying[IShader::MAX_VARYINGS][SIZE];
+};
+
+inline int IShader::fragment(const Packet &packet, TGAColor color[]) {
+    int discard = 0, n = nvaryings();
+    for (int i = 0; i < Packet::SIZE; i++) {
+        if (!(packet.mask >> i & 1)) continue;
+        bool d;
+        if (n) {
+            float varying[MAX_VARYINGS];
+            for (int k = 0; k < n; k++) varying[k] = packet.varying[k][i];
+            d = fragment(varying, color[i]);
+        } else {
+            d = fragment(Vec3f(packet.bar[0][i], packet.bar[1][i], packet.bar[2][i]), color[i]);
+        }
+        discard |= d << i;
+    }
+    return discard;
+}
+
 class GL {
 public:
     enum RendererType {
-        VERTEX, LINE, TRIANGLE, TRIANGLE_COLORED,
+        VERTEX, LINE, TRIANGLE, TRIANGLE_COLORED, DEPTH,
     };
 
     enum DepthTestType {
         LESS, GREATER,
     };
 
-    explicit GL(TGAImage *target) : framebuffer(target) {
-        zbuffer = std::vector<float>(
-                static_cast<unsigned long>(framebuffer->get_width() * framebuffer->get_height()));
+    // pixels per side of the blocks shaded by one fragment(), AUTO picks one of them per triangle
+    enum ShadingRate {
+        SHADING_AUTO = 0, SHADING_1X1 = 1, SHADING_2X2 = 2, SHADING_4X4 = 4,
+    };
+
+    explicit GL(TGAImage *target) : GL(target->get_width(), target->get_height()) {
+        framebuffer = target;
         glRenderer(TRIANGLE_COLORED);
+    }
+
+    // no color target, only DEPTH rendering is possible (shadow maps, depth prepasses)
+    GL(int width, int height) : framebuffer(nullptr), width(width), height(height), screen_coords(3) {
+        zbuffer.resize(width, height);
+        glRegion(0, 0, width, height);
+        glRenderer(DEPTH);
         glDepthFunc(GREATER);
+        glLineDepthTest(false);
+        glLodDensity(4.f);
+        glFrustumCulling(true);
+        glZPrepass(false);
+        glShadingRate(SHADING_1X1);
+        tilesX = (width + TILE - 1) / TILE;
+        tilesY = (height + TILE - 1) / TILE;
     }
 
     ~GL() = default;
 
+    // Starts a frame on another target with the same context, the settings are kept but the tile shading rates.
+    // The zbuffer is cleared and only reallocated when the target is larger than all the previous ones.
+    void glTarget(TGAImage *target) {
+        resize(target->get_width(), target->get_height());
+        framebuffer = target;
+    }
+
+    // no color target, the renderer falls back to DEPTH
+    void glTarget(int width, int height) {
+        resize(width, height);
+        framebuffer = nullptr;
+        glRenderer(DEPTH);
+    }
+
+    // every depth test passes for the first fragment, a flag per tile, see DepthBuffer
+    void glClearDepth() {
+        zbuffer.clear(depthFunc == LESS ? MAXFLOAT : -MAXFLOAT);
+    }
+
+    // how the zbuffer stores the depths, FLOAT32 by default, clears it
+    void glDepthFormat(DepthBuffer::Format format) {
+        zbuffer.set_format(format);
+        glClearDepth();
+    }
+
+    // in z prepass mode the draws are only recorded, the shaders must stay alive until glFlush()
     void glDraw();
 
+    // Draws the shader's model count times, the mvp of the instance i is the shader's mvp times transforms[i],
+    // its parameters are params[i * nparams] to params[(i + 1) * nparams - 1], see IShader::set_instance().
+    // Instances outside of the view frustum are skipped, the position of every vertex of a visible instance is
+    // computed once and the vertex shader only runs, for each corner, on the faces on the screen. The positions
+    // are computed here, so the shader's vertex() must return its mvp times the model vertex. The shader's mvp is
+    // restored and its clear_instance() called at the end. In z prepass mode transforms and params must stay alive
+    // until glFlush() as well.
+    void glDrawInstanced(const Matrix *transforms, int count, const float *params = nullptr, int nparams = 0);
+
+    // runs the recorded draws: once depth only for all of them, then shaded with an EQUAL depth test and only by the
+    // triangle that won the pixel, so every pixel is shaded once whatever the submission order, even where triangles
+    // tie. Nothing to do in immediate mode.
+    void glFlush();
+
+    void glZPrepass(bool enable) {
+        zPrepass = enable;
+    }
+
     void glShader(IShader *shader) {
         this->shader = shader;
     }
 
     void glDepthFunc(DepthTestType func) {
+        depthFunc = func;
         switch (func) {
             case LESS:
                 depthTestFunc = depth_less;
@@ -73,29 +255,93 @@ public:
                 depthTestFunc = depth_more;
                 break;
         }
-        for (auto &p: zbuffer) {
-            switch (func) {
-                case LESS:
-                    p = MAXFLOAT;
-                    break;
-                case GREATER:
-                    p = -MAXFLOAT;
-                    break;
-            }
-        }
+        glClearDepth();
     }
 
     void glViewport(int x, int y, int width, int height) {
         viewportMat = viewport(x, y, width, height);
     }
 
-    void glRenderer(RendererType rendererType) {
-        switch (rendererType) {
+    // The target is the width x height pixels from (x, y) of a frame_width x frame_height frame: the viewport and
+    // the screen coordinates are the frame's, the triangles are rasterized as in the whole frame and only the
+    // pixels of the target are written, so they come out exactly as in the frame. glTarget() resets it to a frame
+    // of its own.
+    void glRegion(int x, int y, int frame_width, int frame_height) {
+        originX = x;
+        originY = y;
+        frameWidth = frame_width;
+        frameHeight = frame_height;
+    }
+
+    // points and lines are tested against (and written to) the zbuffer only when enabled,
+    // so a wireframe can be drawn over a previously rendered shaded pass
+    void glLineDepthTest(bool enable) {
+        lineDepthTest = enable;
+    }
+
+    // draw the finest level of detail that spends at least this many pixels of the model's projected
+    // bounding disk per face, 0 always draws the full resolution mesh
+    void glLodDensity(float pixelsPerFace) {
+        lodDensity = pixelsPerFace;
+    }
+
+    // skip draws whose model bounds are entirely outside of the view frustum of the shader's mvp, if it has one
+    void glFrustumCulling(bool enable) {
+        frustumCulling = enable;
+    }
+
+    // Variable rate shading for the next draws. At 2x2 and 4x4 fragment() runs once per block of pixels, at its
+    // center, and its color goes to every pixel of the block that the triangle covers and that passes the depth
+    // test: depth and coverage stay per pixel. SHADING_AUTO takes per triangle the coarsest rate at which a block
+    // spans at most texelsPerSample texels of the shader's texture, see IShader::texcoords(), so the larger
+    // texelsPerSample, the cheaper and blurrier the frame.
+    void glShadingRate(ShadingRate rate, float texelsPerSample = 1.f) {
+        shadingRate = rate;
+        shadingDetail = texelsPerSample;
+    }
+
+    // a fixed rate for some tiles of the target, the coarser of it and the draw's rate is used there
+    void glTileShadingRate(TileRect tiles, ShadingRate rate);
+
+    void glResetStats() {
+        visibleDraws = culledDraws = 0;
+    }
+
+    // Retained mode, for frames that mostly repeat the previous one. The screen is cut in TILE x TILE tiles and the
+    // draws only write to the dirty ones, every triangle is rasterized tile by tile so that redrawing some tiles
+    // gives the same pixels as drawing the whole frame. Each draw adds the tiles it covers to drawnTiles, dirty or
+    // not. Enabling it marks every tile dirty, so does glTarget().
+    void glRetained(bool enable);
+
+    void glInvalidate(TileRect tiles);
+
+    // every tile clean
+    void glValidate();
+
+    bool glDirty(TileRect tiles) const;
+
+    int glDirtyCount() const;
+
+    // clears the zbuffer and the framebuffer of the dirty tiles
+    void glClearDirty();
+
+    // the tiles the model's bounding box covers with this mvp
+    TileRect glScreenTiles(const Matrix &mvp, Model *model) const;
+
+    // the tiles of a triangle's bounding box on the screen
+    TileRect screenTiles(const std::vector<Vec3f> &pts) const;
+
+    // false and the renderer is kept when type needs a color target and there is none
+    bool glRenderer(RendererType type) {
+        if (type != DEPTH && !framebuffer) {
+            std::cerr << "no color target, only the DEPTH renderer is possible\n";
+            return false;
+        }
+        rendererType = type;
+        switch (type) {
             case VERTEX:
-                interpolator = points_interpolator;
-                break;
             case LINE:
-                interpolator = line_interpolator;
+                interpolator = nullptr; // drawn from the model's vertex and edge lists, see glDraw()
                 break;
             case TRIANGLE:
                 interpolator = triangle_interpolator;
@@ -103,16 +349,92 @@ public:
             case TRIANGLE_COLORED:
                 interpolator = default_interpolator;
                 break;
+            case DEPTH:
+                interpolator = depth_interpolator;
+                break;
         }
+        return true;
     }
 
     using DepthTestFunc = bool (*)(float, float);
     using Interpolator = void (*)(GL &, const std::vector<Vec3f> &);
 
     TGAImage *framebuffer;
+    int width;
+    int height;
+    int originX = 0, originY = 0;     // of the target in the frame, see glRegion()
+    int frameWidth = 0, frameHeight = 0;
     IShader *shader;
-    std::vector<float> zbuffer;
+    DepthBuffer zbuffer;
     Matrix viewportMat;
     Interpolator interpolator;
     DepthTestFunc depthTestFunc;
+    RendererType rendererType;
+    DepthTestType depthFunc;
+    bool lineDepthTest;
+    float lodDensity;
+    bool frustumCulling;
+    bool zPrepass;
+    int visibleDraws = 0;
+    int culledDraws = 0;
+    static const int TILE = DepthBuffer::TILE; // a multiple of the Packet size
+    bool retained = false;
+    int tilesX = 0;
+    int tilesY = 0;
+    std::vector<unsigned char> dirtyTiles;
+    TileRect drawnTiles;
+    ShadingRate shadingRate;
+    float shadingDetail;
+    std::vector<unsigned char> tileRates; // per tile, empty when every tile is at 1x1
+
+private:
+    // the target size, the zbuffer and the tiles follow
+    void resize(int width, int height) {
+        this->width = width;
+        this->height = height;
+        glRegion(0, 0, width, height);
+        zbuffer.resize(width, height);
+        tilesX = (width + TILE - 1) / TILE;
+        tilesY = (height + TILE - 1) / TILE;
+        tileRates.clear();
+        glClearDepth();
+        glResetStats();
+        if (retained) glRetained(true);
+    }
+
+    void drawWireframe(Model *model);
+
+    int selectLod(Model *model);
+
+    struct Draw {
+        IShader *shader;
+        const Matrix *transforms; // nullptr for glDraw()
+        int count;
+        const float *params;
+        int nparams;
+        ShadingRate rate;
+        float detail;
+    };
+
+    struct Instance {
+        int index;
+        Matrix mvp;
+    };
+
+    void drawInstance(Model *model, const Matrix &mvp);
+
+    std::vector<Vec3f> screen_coords; // of the triangle being drawn
+    std::vector<Vec3f> vertex_coords; // screen coordinates of every model vertex, reused between draws
+    std::vector<int> vertex_stamps;   // the instance vertex_coords[i] was computed for
+    int stamp = 0;
+    std::vector<Instance> instances;  // the visible ones of the current instanced draw
+    std::vector<Draw> deferred;       // draws waiting for glFlush() in z prepass mode
+
+public:
+    // The z prepass resolves depth ties as the draws do without it, the first triangle wins: its first pass writes
+    // the triangle that won each pixel, the shading pass only shades that one. The triangles are counted per face
+    // of the draws, the same way in both passes.
+    std::vector<unsigned> prepassIds;
+    unsigned *ids = nullptr; // prepassIds during glFlush(), nullptr otherwise
+    unsigned primitive = 0;  // the current triangle
 };
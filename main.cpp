@@ -1,67 +1,135 @@
+#include <algorithm>
 #include <vector>
 #include <limits>
 #include <iostream>
-#include "tgaimage.h"
-#include "model.h"
-#include "gl.h"
-#include "shader.h"
+#include <cstring>
+#include "distribute.h"
+#include "render.h"
+#include "server.h"
 
-void glRender(const std::vector<std::string> objs,
-              const int width, const int height,
-              const Vec3f &eye, const Vec3f &center, const Vec3f &up,
-              const GL::RendererType renderer, const std::string &output) {
-    auto V = lookat(eye, center, up);
-//    auto P = projection((eye - center).norm());
-    auto len = 1 - 1 / (eye - center).norm();
-    auto P = frustum(-len, len, -len, len, (eye - center).norm() - 1, (eye - center).norm() + 1);
-    TGAImage framebuffer(width, height, TGAImage::RGB);
-    GL gl(&framebuffer);
-    gl.glViewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
-    gl.glRenderer(renderer);
-
-    for (auto &obj : objs) {
-        Model model(obj.data());
-        BumpShader shader;
-        shader.set_mvp(P * V);
-        shader.set_model(&model);
-
-        gl.glShader(&shader);
-        gl.glDraw();
+namespace {
+    // tga, tga-raw, ppm, raw:<path>, rgb:<path> with "-" for stdout, or shm:<name>, see framesink.h
+    std::unique_ptr<FrameSink> make_sink(const std::string &spec) {
+        std::string arg = spec.substr(spec.find(':') + 1);
+        if (spec == "tga") return std::unique_ptr<FrameSink>(new TgaFileSink(true));
+        if (spec == "tga-raw") return std::unique_ptr<FrameSink>(new TgaFileSink(false));
+        if (spec == "ppm") return std::unique_ptr<FrameSink>(new PpmFileSink());
+        if (!spec.compare(0, 4, "shm:")) return std::unique_ptr<FrameSink>(new ShmRingSink(arg));
+        if (!spec.compare(0, 4, "raw:") || !spec.compare(0, 4, "rgb:")) {
+            std::unique_ptr<RawStreamSink> sink(new RawStreamSink(arg, spec[0] == 'r' && spec[1] == 'g'));
+            if (sink->is_open()) return sink;
+        }
+        return nullptr;
     }
 
-    framebuffer.flip_vertically();
-    framebuffer.write_tga_file(output.data());
+    std::vector<std::string> split(const std::string &list, char separator) {
+        std::vector<std::string> items;
+        for (size_t pos = 0, end; pos <= list.size(); pos = end + 1) {
+            end = std::min(list.find(separator, pos), list.size());
+            if (end > pos) items.push_back(list.substr(pos, end - pos));
+        }
+        return items;
+    }
 }
 
 int main(int argc, char **argv) {
-    std::vector<std::string> objs;
+    Model::TextureStorage storage = Model::RAW_TEXTURES;
+    int queue_depth = 2;
+    std::string sink_spec = "tga";
+    std::vector<std::string> workers;
+    int region = 256;
+    for (; argc > 1; argc--) {
+        const char *flag = argv[argc - 1];
+        if (!strcmp(flag, "--compressed")) {
+            storage = Model::COMPRESSED_TEXTURES;
+        } else if (!strncmp(flag, "--paged", 7)) {
+            storage = Model::PAGED_TEXTURES;
+            Texture::set_paging(16 << 20, !strcmp(flag, "--paged-async"));
+        } else if (!strncmp(flag, "--tile-cache=", 13)) {
+            Texture::set_tile_cache(flag + 13);
+        } else if (!strncmp(flag, "--queue=", 8)) {
+            queue_depth = std::atoi(flag + 8);
+        } else if (!strncmp(flag, "--sink=", 7)) {
+            sink_spec = flag + 7;
+        } else if (!strncmp(flag, "--workers=", 10)) {
+            workers = split(flag + 10, ',');
+        } else if (!strncmp(flag, "--region=", 9)) {
+            region = std::max(1, std::atoi(flag + 9));
+        } else {
+            break;
+        }
+    }
+
+    if (argc > 2 && !strcmp(argv[1], "--serve")) {
+        return serve(argv[2], argc > 3 ? std::atoi(argv[3]) : 0, storage);
+    }
+
+    RenderJob job;
 
     if (argc < 2) {
-        objs.emplace_back("../obj/african_head/african_head.obj");
-        objs.emplace_back("../obj/african_head/african_head_eye_inner.obj");
+        job.objs.emplace_back("../obj/african_head/african_head.obj");
+        job.objs.emplace_back("../obj/african_head/african_head_eye_inner.obj");
 
         std::cerr << "Usage: " << argv[0] << " obj/model.obj" << std::endl;
+        std::cerr << "       " << argv[0] << " --serve socket|host:port [workers]" << std::endl;
+        std::cerr << "  --compressed last keeps textures block compressed in memory" << std::endl;
+        std::cerr << "  --paged or --paged-async last loads 64x64 texture tiles on demand, 16 MiB per texture"
+                  << std::endl;
+        std::cerr << "  --tile-cache=<dir> keeps the tiles files of --paged there instead of next to the textures"
+                  << std::endl;
+        std::cerr << "  --queue=N frames waiting to be written while the next one renders, 0 writes at once"
+                  << std::endl;
+        std::cerr << "  --sink=tga|tga-raw|ppm files per frame, raw:<path>|rgb:<path> raw frames top down on a file or"
+                  << " pipe (- is stdout), shm:<name> a shared memory ring, see tinyrenderer-shmcat" << std::endl;
+        std::cerr << "  --workers=<address>,... last renders the frames on these render servers, see distribute.h"
+                  << std::endl;
+        std::cerr << "  --region=N pixels per side of the regions sent to the workers, 256 by default" << std::endl;
         std::cerr << "Use default model now!" << std::endl;
     } else {
         for (int m = 1; m < argc; m++) {
-            objs.emplace_back(argv[m]);
+            job.objs.emplace_back(argv[m]);
         }
     }
 
-    const int width = 800;
-    const int height = 800;
-    const Vec3f eye(1, 1, 3);
-    const Vec3f center(0, 0, 0);
-    const Vec3f up(0, 1, 0);
+    std::unique_ptr<FrameSink> sink = make_sink(sink_spec);
+    if (!sink) {
+        std::cerr << "bad sink " << sink_spec << std::endl;
+        return 1;
+    }
+    const std::string ext = sink_spec == "ppm" ? ".ppm" : ".tga";
+    ModelCache cache(storage);
+    FrameWriter writer(std::move(sink), queue_depth);
+    RenderContext context;
 
-    glRender(objs, width, height, eye, center, up, GL::VERTEX, "vertex.tga");
+    // here, or cut in regions rendered by the workers
+    auto render = [&](const RenderJob &job) {
+        if (workers.empty()) return glRender(job, cache, writer, context);
+        std::unique_ptr<TGAImage> framebuffer = writer.acquire(job.width, job.height, TGAImage::RGB);
+        if (!glRenderDistributed(job, workers, *framebuffer, region)) return false;
+        writer.submit(std::move(framebuffer), job.output);
+        return true;
+    };
+    bool rendered = true;
 
-    glRender(objs, width, height, eye, center, up, GL::LINE, "line.tga");
+    job.renderer = GL::VERTEX;
+    job.output = "vertex" + ext;
+    rendered &= render(job);
 
-    glRender(objs, width, height, eye, center, up, GL::TRIANGLE, "triangle.tga");
+    job.renderer = GL::LINE;
+    job.output = "line" + ext;
+    rendered &= render(job);
 
-    glRender(objs, width, height, eye, center, up, GL::TRIANGLE_COLORED, "framebuffer.tga");
+    job.renderer = GL::TRIANGLE;
+    job.output = "triangle" + ext;
+    rendered &= render(job);
 
-    return 0;
-}
+    job.renderer = GL::TRIANGLE_COLORED;
+    job.output = "framebuffer" + ext;
+    rendered &= render(job);
+
+    job.renderer = GL::DEPTH;
+    job.output = "depth" + ext;
+    rendered &= render(job);
 
+    return writer.flush() && rendered ? 0 : 1;
+}
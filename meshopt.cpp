@@ -0,0 +1,133 @@
+#include <deque>
+#include <algorithm>
+#include "meshopt.h"
+
+float acmr(const std::vector<int> &indices, int cache_size) {
+    if (indices.empty()) return 0;
+    std::deque<int> fifo;
+    int misses = 0;
+    for (int v : indices) {
+        if (std::find(fifo.begin(), fifo.end(), v) != fifo.end()) continue;
+        misses++;
+        fifo.push_back(v);
+        if ((int) fifo.size() > cache_size) fifo.pop_front();
+    }
+    return misses / (indices.size() / 3.f);
+}
+
+std::vector<int> tipsify(const std::vector<int> &indices, int nverts, int cache_size, std::vector<int> &clusters) {
+    const int ntris = (int) indices.size() / 3;
+    std::vector<int> offsets(nverts + 1, 0), adjacency(indices.size());
+    for (int v : indices) offsets[v + 1]++;
+    for (int v = 0; v < nverts; v++) offsets[v + 1] += offsets[v];
+    std::vector<int> live(offsets.begin() + 1, offsets.end());
+    for (int v = nverts; v--;) live[v] -= offsets[v];
+    std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+    for (int t = 0; t < ntris; t++) {
+        for (int j = 0; j < 3; j++) adjacency[fill[indices[3 * t + j]]++] = t;
+    }
+
+    const int max_cluster = 64; // smaller clusters give sort_clusters() more to work with
+    std::vector<int> order, candidates, dead_ends;
+    std::vector<int> cache_time(nverts, 0);
+    std::vector<char> emitted(ntris, 0);
+    order.reserve(ntris);
+    clusters.assign(1, 0);
+    int time = cache_size + 1, cursor = 0;
+    int fan = nverts ? 0 : -1;
+    while (fan >= 0) {
+        candidates.clear();
+        for (int k = offsets[fan]; k < offsets[fan + 1]; k++) {
+            int t = adjacency[k];
+            if (emitted[t]) continue;
+            for (int j = 0; j < 3; j++) {
+                int v = indices[3 * t + j];
+                dead_ends.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - cache_time[v] > cache_size) cache_time[v] = time++;
+            }
+            emitted[t] = 1;
+            order.push_back(t);
+        }
+
+        // the candidate that stays in the cache while its remaining triangles are emitted, oldest first
+        int next = -1, best = -1;
+        for (int v : candidates) {
+            if (live[v] <= 0) continue;
+            int priority = 0;
+            if (time - cache_time[v] + 2 * live[v] <= cache_size) priority = time - cache_time[v];
+            if (priority > best) {
+                best = priority;
+                next = v;
+            }
+        }
+        if (next < 0) {
+            while (!dead_ends.empty() && next < 0) {
+                int v = dead_ends.back();
+                dead_ends.pop_back();
+                if (live[v] > 0) next = v;
+            }
+            for (; next < 0 && cursor < nverts; cursor++) {
+                if (live[cursor] > 0) next = cursor;
+            }
+        }
+        int cluster = (int) order.size() - clusters.back();
+        if (next >= 0 && cluster > 0 && (time - cache_time[next] > cache_size || cluster >= max_cluster)) {
+            clusters.push_back((int) order.size());
+        }
+        fan = next;
+    }
+    return order;
+}
+
+std::vector<int> sort_clusters(const std::vector<int> &indices, const std::vector<Vec3f> &verts,
+                               const std::vector<int> &order, const std::vector<int> &clusters) {
+    Vec3f mesh_center;
+    float mesh_area = 0;
+    std::vector<Vec3f> centers(clusters.size()), normals(clusters.size());
+    for (size_t c = 0; c < clusters.size(); c++) {
+        int end = c + 1 < clusters.size() ? clusters[c + 1] : (int) order.size();
+        float area = 0;
+        for (int k = clusters[c]; k < end; k++) {
+            const int *t = &indices[3 * order[k]];
+            Vec3f n = cross(verts[t[1]] - verts[t[0]], verts[t[2]] - verts[t[0]]);
+            float a = n.norm();
+            centers[c] = centers[c] + (verts[t[0]] + verts[t[1]] + verts[t[2]]) * (a / 3);
+            normals[c] = normals[c] + n;
+            area += a;
+        }
+        mesh_center = mesh_center + centers[c];
+        mesh_area += area;
+        if (area > 0) centers[c] = centers[c] / area;
+    }
+    if (mesh_area > 0) mesh_center = mesh_center / mesh_area;
+
+    std::vector<float> key(clusters.size());
+    std::vector<int> sorted(clusters.size());
+    for (size_t c = 0; c < clusters.size(); c++) {
+        key[c] = (centers[c] - mesh_center) * normals[c];
+        sorted[c] = (int) c;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [&](int a, int b) { return key[a] > key[b]; });
+
+    std::vector<int> result;
+    result.reserve(order.size());
+    for (int c : sorted) {
+        int end = c + 1 < (int) clusters.size() ? clusters[c + 1] : (int) order.size();
+        result.insert(result.end(), order.begin() + clusters[c], order.begin() + end);
+    }
+    return result;
+}
+
+std::vector<int> first_use_order(const std::vector<int> &indices, int nverts) {
+    std::vector<int> remap(nverts, -1);
+    int next = 0;
+    for (int v : indices) {
+        if (remap[v] < 0) remap[v] = next++;
+    }
+    for (int &r : remap) {
+        if (r < 0) r = next++;
+    }
+    return remap;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+
+// Triangle and vertex order optimization. indices is a flat triangle list of vertex indices.
+
+// average cache miss ratio: vertices transformed per triangle with a FIFO post-transform cache of cache_size
+float acmr(const std::vector<int> &indices, int cache_size = 16);
+
+// Tipsify (Sander, Nehab, Barczak 2007): returns the triangles in vertex cache friendly order.
+// clusters receives the position in that order where each cluster starts: a dead end of the fanning,
+// a fan vertex that has already left the cache (so reordering clusters costs little cache efficiency),
+// or at the latest every 64 triangles.
+std::vector<int> tipsify(const std::vector<int> &indices, int nverts, int cache_size, std::vector<int> &clusters);
+
+// view independent overdraw reduction (same paper): the clusters facing away from the mesh centroid,
+// which tend to occlude the others, are moved first. order and clusters come from tipsify().
+std::vector<int> sort_clusters(const std::vector<int> &indices, const std::vector<Vec3f> &verts,
+                               const std::vector<int> &order, const std::vector<int> &clusters);
+
+// new index of every vertex in the order of its first use, unused vertices go last
+std::vector<int> first_use_order(const std::vector<int> &indices, int nverts);
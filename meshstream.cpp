@@ -0,0 +1,451 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include "gl.h"
+#include "meshstream.h"
+#include "trace.h"
+
+namespace {
+    const char CHUNKS_MAGIC[8] = "TRCHNK1";
+    const int MAX_CELLS_PER_AXIS = 256;
+    // what a face takes in a Model: a std::vector of 3 Vec3i on the heap, with the allocator's overhead
+    const size_t MODEL_FACE_BYTES = sizeof(std::vector<Vec3i>) + 3 * sizeof(Vec3i) + 16;
+    const size_t MODEL_VERT_BYTES = 2 * sizeof(Vec3f) + sizeof(Vec2f) + sizeof(Vec2i);
+
+    struct ChunksHeader {
+        char magic[8];
+        int nchunks;
+        int max_verts;
+        int max_faces;
+        int pad;
+        long long table; // offset of the MeshStream::Entry of every chunk
+        long long source_size;
+        long long source_mtime;
+    };
+
+    // the bytes of a chunk: the positions, the uvs, the normals, then 3 vertex indices per face
+    size_t chunk_bytes(int nverts, int nfaces) {
+        return static_cast<size_t>(nverts) * (2 * sizeof(Vec3f) + sizeof(Vec2f)) + static_cast<size_t>(nfaces) * 3 * sizeof(int);
+    }
+
+    // A temporary file next to the output, already unlinked: appended to, then mapped for reading, or sized and
+    // mapped for writing. The pages are the file's, so the kernel can drop them under memory pressure.
+    class Spill {
+    public:
+        ~Spill() {
+            if (data) munmap(data, size);
+            if (file) fclose(file);
+        }
+
+        bool create(const std::string &prefix) {
+            std::string name = prefix + ".XXXXXX";
+            int fd = mkstemp(&name[0]);
+            if (fd < 0) return false;
+            unlink(name.c_str());
+            file = fdopen(fd, "w+b");
+            return file != nullptr;
+        }
+
+        void append(const void *p, size_t n) {
+            if (fwrite(p, 1, n, file) != n) failed = true;
+            size += n;
+        }
+
+        bool map_read() {
+            if (fflush(file) || failed) return false;
+            if (!size) return true;
+            void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fileno(file), 0);
+            data = p == MAP_FAILED ? nullptr : static_cast<unsigned char *>(p);
+            return data != nullptr;
+        }
+
+        bool map_write(size_t bytes) {
+            size = bytes;
+            if (!size) return true;
+            if (ftruncate(fileno(file), static_cast<off_t>(size))) return false;
+            void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+            data = p == MAP_FAILED ? nullptr : static_cast<unsigned char *>(p);
+            return data != nullptr;
+        }
+
+        template<typename T>
+        T *as() const {
+            return reinterpret_cast<T *>(data);
+        }
+
+    private:
+        FILE *file = nullptr;
+        unsigned char *data = nullptr;
+        size_t size = 0;
+        bool failed = false;
+    };
+
+    // "v", "v/t", "v//n" or "v/t/n", 1-based or negative (relative to the end), -1 when missing
+    const char *parse_corner(const char *s, const long long counts[3], int corner[3]) {
+        for (int i = 0; i < 3; i++) corner[i] = -1;
+        for (int i = 0; i < 3; i++) {
+            char *end;
+            long long k = std::strtoll(s, &end, 10);
+            if (end != s) corner[i] = static_cast<int>(k < 0 ? counts[i] + k : k - 1);
+            s = end;
+            if (*s != '/') break;
+            s++;
+        }
+        return s;
+    }
+
+    struct Corner {
+        int v, t, n;
+
+        bool operator==(const Corner &o) const {
+            return v == o.v && t == o.t && n == o.n;
+        }
+    };
+
+    struct CornerHash {
+        size_t operator()(const Corner &c) const {
+            return (static_cast<size_t>(c.v) * 0x9E3779B97F4A7C15ull) ^ (static_cast<size_t>(c.t) * 0xC2B2AE3D27D4EB4Full) ^
+                   static_cast<size_t>(c.n);
+        }
+    };
+}
+
+bool build_chunks(const char *obj, const std::string &chunks, int faces_per_chunk) {
+    TRACE_SCOPE("mesh chunking");
+    struct stat source;
+    FILE *in = fopen(obj, "r");
+    if (!in || fstat(fileno(in), &source)) {
+        if (in) fclose(in);
+        std::cerr << "can't read " << obj << "\n";
+        return false;
+    }
+    // the obj once: the positions, uvs and normals as arrays, the faces as triangles of (v, t, n) corners
+    Spill positions, uvs, normals, triangles;
+    if (!positions.create(chunks) || !uvs.create(chunks) || !normals.create(chunks) || !triangles.create(chunks)) {
+        fclose(in);
+        std::cerr << "can't create temporary files for " << chunks << "\n";
+        return false;
+    }
+    long long counts[3] = {0, 0, 0}, nfaces = 0;
+    Vec3f lo(MAXFLOAT, MAXFLOAT, MAXFLOAT), hi(-MAXFLOAT, -MAXFLOAT, -MAXFLOAT);
+    std::vector<int> polygon;
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+        char *s = line;
+        if (s[0] == 'v' && s[1] == ' ') {
+            s++;
+            Vec3f v;
+            for (int i = 0; i < 3; i++) v[i] = std::strtof(s, &s);
+            for (int i = 0; i < 3; i++) lo[i] = std::min(lo[i], v[i]), hi[i] = std::max(hi[i], v[i]);
+            positions.append(&v, sizeof(v));
+            counts[0]++;
+        } else if (s[0] == 'v' && s[1] == 't' && s[2] == ' ') {
+            s += 2;
+            Vec2f uv;
+            for (int i = 0; i < 2; i++) uv[i] = std::strtof(s, &s);
+            uvs.append(&uv, sizeof(uv));
+            counts[1]++;
+        } else if (s[0] == 'v' && s[1] == 'n' && s[2] == ' ') {
+            s += 2;
+            Vec3f n;
+            for (int i = 0; i < 3; i++) n[i] = std::strtof(s, &s);
+            normals.append(&n, sizeof(n));
+            counts[2]++;
+        } else if (s[0] == 'f' && s[1] == ' ') {
+            polygon.clear();
+            s++;
+            while (true) {
+                while (*s == ' ' || *s == '\t') s++;
+                if (!*s || *s == '\n' || *s == '\r') break;
+                int corner[3];
+                const char *end = parse_corner(s, counts, corner);
+                if (end == s) break;
+                s = const_cast<char *>(end);
+                polygon.insert(polygon.end(), corner, corner + 3);
+            }
+            for (size_t k = 6; k + 3 <= polygon.size(); k += 3) { // a fan
+                triangles.append(&polygon[0], 3 * sizeof(int));
+                triangles.append(&polygon[k - 3], 6 * sizeof(int));
+                nfaces++;
+            }
+        }
+    }
+    fclose(in);
+    if (!nfaces) {
+        std::cerr << "no face in " << obj << "\n";
+        return false;
+    }
+    if (!positions.map_read() || !uvs.map_read() || !normals.map_read() || !triangles.map_read()) {
+        std::cerr << "can't spill " << obj << " to temporary files\n";
+        return false;
+    }
+    const Vec3f *P = positions.as<Vec3f>(), *N = normals.as<Vec3f>();
+    const Vec2f *T = uvs.as<Vec2f>();
+    const int *F = triangles.as<int>();
+
+    // a grid of about nfaces / faces_per_chunk cells over the bounding box, cells of the same size on every axis
+    Vec3f extent = hi - lo;
+    float largest = std::max(extent.x, std::max(extent.y, extent.z));
+    for (int i = 0; i < 3; i++) extent[i] = std::max(extent[i], largest * 1e-3f + 1e-6f);
+    double wanted = std::max(1.0, double(nfaces) / faces_per_chunk);
+    double cell = std::cbrt(double(extent.x) * extent.y * extent.z / wanted);
+    int dims[3];
+    for (int i = 0; i < 3; i++) dims[i] = std::min(MAX_CELLS_PER_AXIS, std::max(1, int(std::ceil(extent[i] / cell))));
+    auto cell_of = [&](long long f) {
+        int c[3];
+        for (int i = 0; i < 3; i++) {
+            float centroid = 0.f;
+            for (int j = 0; j < 3; j++) {
+                int v = F[f * 9 + j * 3];
+                if (v >= 0 && v < counts[0]) centroid += P[v][i];
+            }
+            c[i] = std::min(dims[i] - 1, std::max(0, int((centroid / 3.f - lo[i]) / extent[i] * dims[i])));
+        }
+        return (static_cast<size_t>(c[2]) * dims[1] + c[1]) * dims[0] + c[0];
+    };
+    // counting sort of the faces by cell, into a mapped file of face indices
+    std::vector<long long> start(static_cast<size_t>(dims[0]) * dims[1] * dims[2] + 1, 0);
+    for (long long f = 0; f < nfaces; f++) start[cell_of(f) + 1]++;
+    for (size_t c = 1; c < start.size(); c++) start[c] += start[c - 1];
+    Spill sorted;
+    if (!sorted.create(chunks) || !sorted.map_write(static_cast<size_t>(nfaces) * sizeof(long long))) {
+        std::cerr << "can't create temporary files for " << chunks << "\n";
+        return false;
+    }
+    long long *order = sorted.as<long long>();
+    {
+        std::vector<long long> next(start.begin(), start.end() - 1);
+        for (long long f = 0; f < nfaces; f++) order[next[cell_of(f)]++] = f;
+    }
+
+    std::string tmp = chunks + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (!out) {
+        std::cerr << "can't write " << tmp << "\n";
+        return false;
+    }
+    ChunksHeader header = {};
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    long long offset = sizeof(header);
+    std::vector<MeshStream::Entry> table;
+    std::unordered_map<Corner, int, CornerHash> index;
+    std::vector<Vec3f> verts, norms;
+    std::vector<Vec2f> uv;
+    std::vector<int> faces;
+    for (size_t c = 0; c + 1 < start.size() && ok; c++) {
+        for (long long first = start[c]; first < start[c + 1] && ok; first += faces_per_chunk) {
+            long long last = std::min(start[c + 1], first + faces_per_chunk);
+            index.clear();
+            verts.clear(), uv.clear(), norms.clear(), faces.clear();
+            for (long long k = first; k < last; k++) {
+                const int *t = F + order[k] * 9;
+                for (int j = 0; j < 3; j++) {
+                    Corner corner = {t[j * 3], t[j * 3 + 1], t[j * 3 + 2]};
+                    auto it = index.emplace(corner, static_cast<int>(verts.size()));
+                    if (it.second) {
+                        verts.push_back(corner.v >= 0 && corner.v < counts[0] ? P[corner.v] : Vec3f());
+                        uv.push_back(corner.t >= 0 && corner.t < counts[1] ? T[corner.t] : Vec2f());
+                        norms.push_back(corner.n >= 0 && corner.n < counts[2] ? N[corner.n] : Vec3f(0, 0, 1));
+                    }
+                    faces.push_back(it.first->second);
+                }
+            }
+            MeshStream::Entry entry = {offset, static_cast<int>(verts.size()), static_cast<int>(last - first),
+                                       verts[0], verts[0]};
+            for (auto &v : verts) {
+                for (int i = 0; i < 3; i++) entry.lo[i] = std::min(entry.lo[i], v[i]), entry.hi[i] = std::max(entry.hi[i], v[i]);
+            }
+            ok = fwrite(verts.data(), sizeof(Vec3f), verts.size(), out) == verts.size() &&
+                 fwrite(uv.data(), sizeof(Vec2f), uv.size(), out) == uv.size() &&
+                 fwrite(norms.data(), sizeof(Vec3f), norms.size(), out) == norms.size() &&
+                 fwrite(faces.data(), sizeof(int), faces.size(), out) == faces.size();
+            offset += static_cast<long long>(chunk_bytes(entry.nverts, entry.nfaces));
+            header.max_verts = std::max(header.max_verts, entry.nverts);
+            header.max_faces = std::max(header.max_faces, entry.nfaces);
+            table.push_back(entry);
+        }
+    }
+    memcpy(header.magic, CHUNKS_MAGIC, sizeof(CHUNKS_MAGIC));
+    header.nchunks = static_cast<int>(table.size());
+    header.table = offset;
+    header.source_size = source.st_size;
+    header.source_mtime = source.st_mtime;
+    ok = ok && fwrite(table.data(), sizeof(MeshStream::Entry), table.size(), out) == table.size();
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = fclose(out) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), chunks.c_str()) == 0;
+    if (!ok) {
+        unlink(tmp.c_str());
+        std::cerr << "can't write " << chunks << "\n";
+        return false;
+    }
+    std::cerr << "# " << obj << ": " << nfaces << " faces in " << table.size() << " chunks of a " << dims[0] << "x"
+              << dims[1] << "x" << dims[2] << " grid" << std::endl;
+    return true;
+}
+
+MeshStream::MeshStream(size_t budget) : budget(budget) {}
+
+MeshStream::~MeshStream() {
+    stop_loader();
+    if (fd >= 0) close(fd);
+}
+
+// waits for the chunk being read, if any: the loader must not touch the file, the table or the slots after this
+void MeshStream::stop_loader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (loader.joinable()) loader.join();
+    stopping = false;
+}
+
+bool MeshStream::open(const char *obj, Model::TextureStorage storage, const std::string &chunks) {
+    std::string path = chunks.empty() ? std::string(obj) + ".chunks" : chunks;
+    struct stat source;
+    if (stat(obj, &source)) {
+        std::cerr << "can't read " << obj << "\n";
+        return false;
+    }
+    stop_loader();
+    ChunksHeader header;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (fd >= 0) close(fd);
+        fd = ::open(path.c_str(), O_RDONLY);
+        bool valid = fd >= 0 && pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+                     !memcmp(header.magic, CHUNKS_MAGIC, sizeof(CHUNKS_MAGIC)) &&
+                     header.source_size == source.st_size && header.source_mtime == source.st_mtime;
+        if (valid) break;
+        if (attempt || !build_chunks(obj, path)) {
+            std::cerr << "can't stream " << obj << "\n";
+            return false;
+        }
+    }
+    table.resize(static_cast<size_t>(header.nchunks));
+    size_t table_bytes = table.size() * sizeof(Entry);
+    if (pread(fd, table.data(), table_bytes, header.table) != (ssize_t) table_bytes) {
+        std::cerr << "can't read the chunks of " << path << "\n";
+        return false;
+    }
+    materials.reset(new Model(obj, storage, false));
+    max_chunk_bytes = chunk_bytes(header.max_verts, header.max_faces);
+    slot_bytes = header.max_verts * MODEL_VERT_BYTES + header.max_faces * MODEL_FACE_BYTES;
+    size_t room = budget > max_chunk_bytes ? budget - max_chunk_bytes : 0; // the read buffer takes one chunk
+    int n = static_cast<int>(std::max<size_t>(2, std::min<size_t>(64, room / std::max<size_t>(1, slot_bytes))));
+    std::lock_guard<std::mutex> lock(mutex);
+    models.clear();
+    free.clear();
+    for (int i = 0; i < n; i++) {
+        models.emplace_back(new Model());
+        free.push_back(i);
+    }
+    pass.clear();
+    ready.clear();
+    cursor = 0;
+    read_bytes = 0;
+    loader = std::thread(&MeshStream::load, this);
+    return true;
+}
+
+void MeshStream::start(const Matrix &mvp) {
+    std::lock_guard<std::mutex> lock(mutex);
+    generation++;
+    for (int slot : ready) free.push_back(slot);
+    ready.clear();
+    pass.clear();
+    for (int i = 0; i < (int) table.size(); i++) {
+        if (!outside_frustum(mvp, table[i].lo, table[i].hi)) pass.push_back(i);
+    }
+    cursor = 0;
+    wake.notify_all();
+}
+
+Model *MeshStream::next() {
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock, [this] { return !ready.empty() || (cursor == pass.size() && !reading); });
+    if (ready.empty()) return nullptr;
+    int slot = ready.front();
+    ready.pop_front();
+    return models[slot].get();
+}
+
+void MeshStream::release(Model *chunk) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < (int) models.size(); i++) {
+        if (models[i].get() == chunk) free.push_back(i);
+    }
+    wake.notify_all();
+}
+
+int MeshStream::nchunks() const {
+    return static_cast<int>(table.size());
+}
+
+int MeshStream::visible() const {
+    return static_cast<int>(pass.size());
+}
+
+size_t MeshStream::bytes_read() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return read_bytes;
+}
+
+size_t MeshStream::footprint() const {
+    return models.size() * slot_bytes + max_chunk_bytes;
+}
+
+int MeshStream::slots() const {
+    return static_cast<int>(models.size());
+}
+
+// one chunk at a time into a free slot, the Model is the loader's until the chunk is queued
+void MeshStream::load() {
+    std::vector<unsigned char> buffer;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || (cursor < pass.size() && !free.empty()); });
+        if (stopping) return;
+        const Entry entry = table[pass[cursor++]];
+        int slot = free.back();
+        free.pop_back();
+        unsigned current = generation;
+        reading++;
+        lock.unlock();
+        size_t bytes = chunk_bytes(entry.nverts, entry.nfaces);
+        buffer.resize(max_chunk_bytes);
+        bool ok;
+        {
+            TRACE_SCOPE("chunk read");
+            ok = pread(fd, buffer.data(), bytes, entry.offset) == (ssize_t) bytes;
+        }
+        if (ok) {
+            const unsigned char *p = buffer.data();
+            const Vec3f *verts = reinterpret_cast<const Vec3f *>(p);
+            const Vec2f *uv = reinterpret_cast<const Vec2f *>(p + entry.nverts * sizeof(Vec3f));
+            const Vec3f *norms = reinterpret_cast<const Vec3f *>(p + entry.nverts * (sizeof(Vec3f) + sizeof(Vec2f)));
+            const int *faces = reinterpret_cast<const int *>(p + entry.nverts * (2 * sizeof(Vec3f) + sizeof(Vec2f)));
+            models[slot]->assign(*materials, entry.nverts, verts, uv, norms, entry.nfaces, faces);
+        } else {
+            std::cerr << "can't read a chunk at " << entry.offset << "\n";
+        }
+        lock.lock();
+        reading--;
+        read_bytes += bytes;
+        if (ok && current == generation) {
+            ready.push_back(slot);
+        } else {
+            free.push_back(slot);
+        }
+        wake.notify_all();
+    }
+}
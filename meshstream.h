@@ -0,0 +1,90 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+
+// Meshes too large for memory are drawn a chunk at a time. <obj>.chunks holds the triangles of the obj cut along a
+// grid into chunks of at most faces_per_chunk faces, each with its own vertices (one per distinct vertex/uv/normal
+// triple of the obj) and its bounding box. The obj is read once and the faces are sorted into their grid cells
+// through temporary files next to the output, so the build holds the chunk being written and a counter per cell
+// only. The header goes last, a partial file is never mistaken for a valid one.
+bool build_chunks(const char *obj, const std::string &chunks, int faces_per_chunk = 4096);
+
+// Streams the chunks of one mesh: a pass takes the chunks in a view frustum, in file order, and a loader thread
+// reads them ahead of the renderer into a fixed set of Models, as many as the memory budget holds (at least 2).
+// Chunks outside the frustum are never read. The memory does not depend on the size of the mesh, only on the
+// budget and the size of the largest chunk. The chunk Models share the textures of the obj. Single consumer.
+class MeshStream {
+public:
+    explicit MeshStream(size_t budget = 64 << 20);
+
+    MeshStream(const MeshStream &) = delete;
+
+    MeshStream &operator=(const MeshStream &) = delete;
+
+    ~MeshStream();
+
+    // The chunks of obj, <obj>.chunks by default, built when missing or older than the obj. Opening again stops the
+    // loader first and drops the chunks of the previous open(), which must all have been released.
+    bool open(const char *obj, Model::TextureStorage storage = Model::RAW_TEXTURES, const std::string &chunks = "");
+
+    // Starts a pass over the chunks that may be in the view frustum of mvp (object to clip space). Every chunk of
+    // the previous pass must have been released, the ones not taken by next() yet are dropped.
+    void start(const Matrix &mvp);
+
+    // the next chunk of the pass, once read, nullptr after the last one; valid until release()
+    Model *next();
+
+    void release(Model *chunk);
+
+    int nchunks() const;
+
+    // the chunks of the current pass
+    int visible() const;
+
+    // bytes read from the chunks file since open()
+    size_t bytes_read();
+
+    // the memory of the chunk Models and of the read buffer when every slot holds the largest chunk
+    size_t footprint() const;
+
+    int slots() const;
+
+    struct Entry {
+        long long offset;
+        int nverts, nfaces;
+        Vec3f lo, hi;
+    };
+
+private:
+    size_t budget;
+    int fd = -1;
+    std::vector<Entry> table;
+    size_t slot_bytes = 0;
+    size_t max_chunk_bytes = 0;
+    std::unique_ptr<Model> materials; // the textures only
+    std::vector<std::unique_ptr<Model> > models;
+
+    std::mutex mutex;
+    std::condition_variable wake; // the loader waits for a chunk to read and a free slot, next() for a read chunk
+    std::vector<int> pass;        // chunks
+    size_t cursor = 0;            // the next chunk of pass to read
+    int reading = 0;              // chunks being read
+    std::deque<int> ready;        // slots, in pass order
+    std::vector<int> free;        // slots
+    unsigned generation = 0;      // of the pass, a chunk read for an earlier pass is dropped
+    size_t read_bytes = 0;
+    bool stopping = false;
+    std::thread loader;
+
+    void load();
+
+    void stop_loader();
+};
@@ -1,9 +1,23 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <limits>
 #include "model.h"
+#include "simplify.h"
+#include "meshopt.h"
+#include "trace.h"
 
-Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffusemap_(), normalmap_(), specularmap_() {
+Model::Model(const char *filename, TextureStorage storage, bool geometry) : Model() {
+    TRACE_SCOPE("model load");
+    Texture::Format formats[3][2] = {{Texture::RAW,   Texture::RAW},
+                                     {Texture::BC1,   Texture::BC5},
+                                     {Texture::PAGED, Texture::PAGED}};
+    if (!geometry) {
+        load_texture(filename, "_diffuse.tga", *diffusemap_, formats[storage][0]);
+        load_texture(filename, "_nm_tangent.tga", *normalmap_, formats[storage][1]);
+        return;
+    }
     std::ifstream in;
     in.open(filename, std::ifstream::in);
     if (in.fail()) return;
@@ -40,11 +54,18 @@ Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffus
     }
     std::cerr << "# v# " << verts_.size() << " f# " << faces_.size() << " vt# " << uv_.size() << " vn# "
               << norms_.size() << std::endl;
-    load_texture(filename, "_diffuse.tga", diffusemap_);
-    load_texture(filename, "_nm_tangent.tga", normalmap_);
-//    load_texture(filename, "_spec.tga", specularmap_);
+    build_edges();
+    build_bounds();
+    load_texture(filename, "_diffuse.tga", *diffusemap_, formats[storage][0]);
+    load_texture(filename, "_nm_tangent.tga", *normalmap_, formats[storage][1]);
+//    load_texture(filename, "_spec.tga", *specularmap_, Texture::RAW);
 }
 
+Model::Model() : verts_(), faces_(), lod_faces_(), norms_(), uv_(), edges_(), corners_(), lods_(), lods_built_(false),
+                 lods_mutex_(), bbox_min_(), bbox_max_(),
+                 center_(), radius_(0), diffusemap_(std::make_shared<Texture>()),
+                 normalmap_(std::make_shared<Texture>()), specularmap_(std::make_shared<Texture>()) {}
+
 Model::~Model() {}
 
 int Model::nverts() {
@@ -55,10 +76,220 @@ int Model::nfaces() {
     return (int) faces_.size();
 }
 
-std::vector<int> Model::face(int idx) {
-    std::vector<int> face;
-    for (int i = 0; i < (int) faces_[idx].size(); i++) face.push_back(faces_[idx][i][0]);
-    return face;
+int Model::nlods() {
+    ensure_lods();
+    return (int) lods_.size();
+}
+
+Vec2i Model::lod(int level) {
+    if (!level) return {0, (int) faces_.size()};
+    ensure_lods();
+    return lods_[level];
+}
+
+void Model::ensure_lods() {
+    if (lods_built_.load(std::memory_order_acquire)) return;
+    std::lock_guard<std::mutex> lock(lods_mutex_);
+    if (lods_built_.load(std::memory_order_relaxed)) return;
+    build_lods();
+    lods_built_.store(true, std::memory_order_release);
+}
+
+Vec3f Model::bbox_min() {
+    return bbox_min_;
+}
+
+Vec3f Model::bbox_max() {
+    return bbox_max_;
+}
+
+Vec3f Model::center() {
+    return center_;
+}
+
+float Model::radius() {
+    return radius_;
+}
+
+Vec3i Model::face(int idx) {
+    const std::vector<Vec3i> &f = face_corners(idx);
+    return {f[0][0], f[1][0], f[2][0]};
+}
+
+void Model::build_edges() {
+    std::vector<long long> keys;
+    corners_.assign(verts_.size(), Vec2i(-1, -1));
+    for (int i = 0; i < (int) faces_.size(); i++) {
+        int n = (int) faces_[i].size();
+        for (int j = 0; j < n; j++) {
+            int a = faces_[i][j][0];
+            int b = faces_[i][(j + 1) % n][0];
+            if (corners_[a].x < 0) corners_[a] = Vec2i(i, j);
+            if (a > b) std::swap(a, b);
+            keys.push_back((long long) a << 32 | b);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    edges_.clear();
+    edges_.reserve(keys.size());
+    for (long long k : keys) edges_.emplace_back((int) (k >> 32), (int) (k & 0xffffffff));
+}
+
+void Model::build_bounds() {
+    if (verts_.empty()) return;
+    bbox_min_ = bbox_max_ = verts_[0];
+    for (auto &v : verts_) {
+        for (int i = 0; i < 3; i++) {
+            bbox_min_[i] = std::min(bbox_min_[i], v[i]);
+            bbox_max_[i] = std::max(bbox_max_[i], v[i]);
+        }
+    }
+    center_ = (bbox_min_ + bbox_max_) * .5f;
+    radius_ = 0;
+    for (auto &v : verts_) radius_ = std::max(radius_, (v - center_).norm());
+}
+
+// Every level halves the previous one until the seams and borders (which are never collapsed) are all that is left.
+// Into lod_faces_, so that the threads drawing level 0 meanwhile keep reading faces_ as it is.
+void Model::build_lods() {
+    TRACE_SCOPE("model lods");
+    const int max_lods = 8;
+    const size_t min_faces = 64;
+    lods_.assign(1, Vec2i(0, (int) faces_.size()));
+    lod_faces_.clear();
+    std::vector<Vec3i> corners;
+    for (auto &f : faces_) {
+        if (f.size() != 3) return;
+        corners.insert(corners.end(), f.begin(), f.end());
+    }
+    std::cerr << "# lod f# " << faces_.size();
+    while ((int) lods_.size() < max_lods && corners.size() / 3 >= min_faces) {
+        size_t n = corners.size() / 3;
+        std::vector<Vec3i> next = simplify(verts_, corners, n / 2);
+        if (next.size() / 3 > n * 3 / 4) break;
+        int begin = (int) (faces_.size() + lod_faces_.size());
+        for (size_t i = 0; i < next.size(); i += 3) {
+            lod_faces_.push_back(std::vector<Vec3i>(next.begin() + i, next.begin() + i + 3));
+        }
+        lods_.emplace_back(begin, (int) (faces_.size() + lod_faces_.size()));
+        std::cerr << " " << next.size() / 3;
+        corners.swap(next);
+    }
+    std::cerr << std::endl;
+}
+
+void Model::optimize(int cache_size) {
+    for (auto &f : faces_) {
+        if (f.size() != 3) return;
+    }
+    ensure_lods();
+    for (auto &range : lods_) {
+        std::vector<std::vector<Vec3i> > &level = range.x ? lod_faces_ : faces_;
+        const int first = range.x ? range.x - (int) faces_.size() : 0;
+        std::vector<int> indices, clusters;
+        for (int f = first; f < first + range.y - range.x; f++) {
+            for (int j = 0; j < 3; j++) indices.push_back(level[f][j][0]);
+        }
+        std::vector<int> order = tipsify(indices, nverts(), cache_size, clusters);
+        order = sort_clusters(indices, verts_, order, clusters);
+        std::vector<std::vector<Vec3i> > reordered;
+        reordered.reserve(order.size());
+        for (int t : order) reordered.push_back(level[first + t]);
+        std::copy(reordered.begin(), reordered.end(), level.begin() + first);
+    }
+
+    // vertex, uv and normal indices are independent in an obj, each gets its own first use order
+    std::vector<int> indices;
+    for (int k = 0; k < 3; k++) {
+        int n = (int) (k == 0 ? verts_.size() : k == 1 ? uv_.size() : norms_.size());
+        indices.clear();
+        for (auto &f : faces_) {
+            for (auto &c : f) {
+                if (c[k] >= 0 && c[k] < n) indices.push_back(c[k]);
+            }
+        }
+        std::vector<int> remap = first_use_order(indices, n);
+        for (auto *level : {&faces_, &lod_faces_}) {
+            for (auto &f : *level) {
+                for (auto &c : f) {
+                    if (c[k] >= 0 && c[k] < n) c[k] = remap[c[k]];
+                }
+            }
+        }
+        if (k == 0) {
+            std::vector<Vec3f> v(verts_.size());
+            for (int i = 0; i < n; i++) v[remap[i]] = verts_[i];
+            verts_.swap(v);
+        } else if (k == 1) {
+            std::vector<Vec2f> v(uv_.size());
+            for (int i = 0; i < n; i++) v[remap[i]] = uv_[i];
+            uv_.swap(v);
+        } else {
+            std::vector<Vec3f> v(norms_.size());
+            for (int i = 0; i < n; i++) v[remap[i]] = norms_[i];
+            norms_.swap(v);
+        }
+    }
+    build_edges();
+}
+
+float Model::acmr(int cache_size) {
+    std::vector<int> indices;
+    for (int f = 0; f < nfaces(); f++) {
+        for (auto &c : faces_[f]) indices.push_back(c[0]);
+    }
+    return ::acmr(indices, cache_size);
+}
+
+// level 0 only, the levels of detail are rebuilt on load
+bool Model::write_obj(const char *filename) {
+    std::ofstream out(filename);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    out.precision(std::numeric_limits<float>::max_digits10);
+    for (auto &v : verts_) out << "v " << v.x << " " << v.y << " " << v.z << "\n";
+    for (auto &uv : uv_) out << "vt " << uv.x << " " << uv.y << " 0\n";
+    for (auto &n : norms_) out << "vn " << n.x << " " << n.y << " " << n.z << "\n";
+    for (int f = 0; f < nfaces(); f++) {
+        out << "f";
+        for (auto &c : faces_[f]) out << " " << c[0] + 1 << "/" << c[1] + 1 << "/" << c[2] + 1;
+        out << "\n";
+    }
+    return out.good();
+}
+
+const std::vector<Vec2i> &Model::edges() {
+    if (corners_.size() != verts_.size()) build_edges();
+    return edges_;
+}
+
+Vec2i Model::corner(int i) {
+    if (corners_.size() != verts_.size()) build_edges();
+    return corners_[i];
+}
+
+void Model::assign(const Model &materials, int nverts, const Vec3f *verts, const Vec2f *uv, const Vec3f *norms,
+                   int nfaces, const int *faces) {
+    verts_.assign(verts, verts + nverts);
+    uv_.assign(uv, uv + nverts);
+    norms_.assign(norms, norms + nverts);
+    faces_.resize(nfaces);
+    for (int i = 0; i < nfaces; i++) {
+        faces_[i].resize(3);
+        for (int j = 0; j < 3; j++) faces_[i][j] = Vec3i(faces[3 * i + j], faces[3 * i + j], faces[3 * i + j]);
+    }
+    edges_.clear();
+    corners_.clear();
+    lod_faces_.clear();
+    lods_.assign(1, Vec2i(0, nfaces));
+    lods_built_ = true; // a chunk of a streamed mesh draws as it is
+    build_bounds();
+    diffusemap_ = materials.diffusemap_;
+    normalmap_ = materials.normalmap_;
+    specularmap_ = materials.specularmap_;
 }
 
 Vec3f Model::vert(int i) {
@@ -66,45 +297,86 @@ Vec3f Model::vert(int i) {
 }
 
 Vec3f Model::vert(int iface, int nthvert) {
-    return verts_[faces_[iface][nthvert][0]];
+    return verts_[face_corners(iface)[nthvert][0]];
 }
 
-void Model::load_texture(std::string filename, const char *suffix, TGAImage &img) {
+void Model::load_texture(std::string filename, const char *suffix, Texture &img, Texture::Format format) {
     std::string texfile(filename);
     size_t dot = texfile.find_last_of(".");
     if (dot != std::string::npos) {
         texfile = texfile.substr(0, dot) + std::string(suffix);
-        std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed")
-                  << std::endl;
-        img.flip_vertically();
+        std::cerr << "texture file " << texfile << " loading "
+                  << (img.read_tga_file(texfile.c_str(), format) ? "ok" : "failed") << std::endl;
     }
 }
 
 TGAColor Model::diffuse(Vec2f uvf) {
-    Vec2i uv(uvf[0] * diffusemap_.get_width(), uvf[1] * diffusemap_.get_height());
-    return diffusemap_.get(uv[0], uv[1]);
+    Vec2i uv(uvf[0] * diffusemap_->get_width(), uvf[1] * diffusemap_->get_height());
+    return diffusemap_->get(uv[0], uv[1]);
+}
+
+Vec2i Model::diffuse_size() {
+    return {diffusemap_->get_width(), diffusemap_->get_height()};
 }
 
 Vec3f Model::normal(Vec2f uvf) {
-    Vec2i uv(uvf[0] * normalmap_.get_width(), uvf[1] * normalmap_.get_height());
-    TGAColor c = normalmap_.get(uv[0], uv[1]);
+    Vec2i uv(uvf[0] * normalmap_->get_width(), uvf[1] * normalmap_->get_height());
+    TGAColor c = normalmap_->get(uv[0], uv[1]);
     Vec3f res;
     for (int i = 0; i < 3; i++)
         res[2 - i] = (float) c[i] / 255.f * 2.f - 1.f;
     return res;
 }
 
+void Model::sample_batch(Texture &map, int n, const float *u, const float *v, float *r, float *g, float *b,
+                         int mask) {
+    int w = map.get_width(), h = map.get_height();
+    if (!w || !h) { // no such map, every texel reads as black
+        std::fill(r, r + n, 0.f);
+        std::fill(g, g + n, 0.f);
+        std::fill(b, b + n, 0.f);
+        return;
+    }
+    for (int i = 0; i < n; i += 8) {
+        int k = std::min(8, n - i);
+        int x[8] = {}, y[8] = {}, wanted = (i < 32 ? mask >> i : mask >> 31) & ((1 << k) - 1); // -1 takes them all
+        float lanes[3][8];
+        for (int j = 0; j < k; j++) {
+            if (!(wanted >> j & 1)) continue;
+            x[j] = static_cast<int>(u[i + j] * w);
+            y[j] = static_cast<int>(v[i + j] * h);
+        }
+        map.get8(x, y, lanes[0], lanes[1], lanes[2], wanted);
+        std::copy(lanes[0], lanes[0] + k, r + i);
+        std::copy(lanes[1], lanes[1] + k, g + i);
+        std::copy(lanes[2], lanes[2] + k, b + i);
+    }
+}
+
+void Model::diffuse_batch(int n, const float *u, const float *v, float *r, float *g, float *b, int mask) {
+    sample_batch(*diffusemap_, n, u, v, r, g, b, mask);
+}
+
+void Model::normal_batch(int n, const float *u, const float *v, float *x, float *y, float *z, int mask) {
+    sample_batch(*normalmap_, n, u, v, x, y, z, mask);
+    for (int i = 0; i < n; i++) {
+        x[i] = x[i] / 255.f * 2.f - 1.f;
+        y[i] = y[i] / 255.f * 2.f - 1.f;
+        z[i] = z[i] / 255.f * 2.f - 1.f;
+    }
+}
+
 Vec2f Model::uv(int iface, int nthvert) {
-    return uv_[faces_[iface][nthvert][1]];
+    return uv_[face_corners(iface)[nthvert][1]];
 }
 
 float Model::specular(Vec2f uvf) {
-    Vec2i uv(uvf[0] * specularmap_.get_width(), uvf[1] * specularmap_.get_height());
-    return specularmap_.get(uv[0], uv[1])[0] / 1.f;
+    Vec2i uv(uvf[0] * specularmap_->get_width(), uvf[1] * specularmap_->get_height());
+    return specularmap_->get(uv[0], uv[1])[0] / 1.f;
 }
 
 Vec3f Model::normal(int iface, int nthvert) {
-    int idx = faces_[iface][nthvert][2];
-    return norms_[idx].normalize();
+    Vec3f n = norms_[face_corners(iface)[nthvert][2]]; // a copy, a model is read-only once loaded
+    return n.normalize();
 }
 
@@ -1,25 +1,64 @@
 #ifndef __MODEL_H__
 #define __MODEL_H__
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture.h"
 
 class Model {
 private:
     std::vector<Vec3f> verts_;
     std::vector<std::vector<Vec3i> > faces_; // attention, this Vec3i means vertex/uv/normal
+    std::vector<std::vector<Vec3i> > lod_faces_; // the levels of detail past 0, face faces_.size() + i is lod_faces_[i]
     std::vector<Vec3f> norms_;
     std::vector<Vec2f> uv_;
-    TGAImage diffusemap_;
-    TGAImage normalmap_;
-    TGAImage specularmap_;
+    std::vector<Vec2i> edges_;   // unique (vertex, vertex) pairs, each shared edge appears once
+    std::vector<Vec2i> corners_; // per vertex: one (face, nthvert) that references it, (-1, -1) if unused
+    std::vector<Vec2i> lods_;    // [begin, end) face ranges, level 0 is the mesh as loaded
+    std::atomic<bool> lods_built_;
+    std::mutex lods_mutex_;      // the levels are built on first use, by any of the threads drawing the model
+    Vec3f bbox_min_, bbox_max_;  // axis aligned bounding box
+    Vec3f center_;               // bounding sphere
+    float radius_;
+    std::shared_ptr<Texture> diffusemap_; // shared with the chunks of a MeshStream, see assign()
+    std::shared_ptr<Texture> normalmap_;
+    std::shared_ptr<Texture> specularmap_;
 
-    void load_texture(std::string filename, const char *suffix, TGAImage &img);
+    void load_texture(std::string filename, const char *suffix, Texture &img, Texture::Format format);
+
+    void sample_batch(Texture &map, int n, const float *u, const float *v, float *r, float *g, float *b, int mask);
+
+    void build_edges();
+
+    void build_bounds();
+
+    void build_lods();
+
+    // builds the levels of detail once
+    void ensure_lods();
+
+    const std::vector<Vec3i> &face_corners(int iface) {
+        return iface < (int) faces_.size() ? faces_[iface] : lod_faces_[iface - faces_.size()];
+    }
 
 public:
-    Model(const char *filename);
+    // how the textures are kept in memory, see texture.h:
+    // COMPRESSED_TEXTURES keeps the diffuse map as BC1 and the normal map as BC5,
+    // PAGED_TEXTURES loads tiles of the maps on demand
+    enum TextureStorage {
+        RAW_TEXTURES, COMPRESSED_TEXTURES, PAGED_TEXTURES
+    };
+
+    // without geometry only the textures are loaded, for a mesh streamed from disk, see meshstream.h
+    Model(const char *filename, TextureStorage storage = RAW_TEXTURES, bool geometry = true);
+
+    // no geometry and no texture, filled with assign()
+    Model();
 
     ~Model();
 
@@ -27,6 +66,19 @@ public:
 
     int nfaces();
 
+    // the levels of detail are built on the first call, level 0 alone never builds them
+    int nlods();
+
+    Vec2i lod(int level);
+
+    Vec3f bbox_min();
+
+    Vec3f bbox_max();
+
+    Vec3f center();
+
+    float radius();
+
     Vec3f normal(int iface, int nthvert);
 
     Vec3f normal(Vec2f uv);
@@ -39,9 +91,38 @@ public:
 
     TGAColor diffuse(Vec2f uv);
 
+    // in texels, (0, 0) without a diffuse map
+    Vec2i diffuse_size();
+
     float specular(Vec2f uv);
 
-    std::vector<int> face(int idx);
+    // n samples at once in structure of arrays form, the same values as diffuse() (channels in [0, 255])
+    // and normal(Vec2f) give one at a time, see Texture::get8. Only the samples of the bits set in mask are taken.
+    void diffuse_batch(int n, const float *u, const float *v, float *r, float *g, float *b, int mask = -1);
+
+    void normal_batch(int n, const float *u, const float *v, float *x, float *y, float *z, int mask = -1);
+
+    // the vertex indices of a triangle
+    Vec3i face(int idx);
+
+    // reorders the faces of every level of detail for the post-transform vertex cache, then for overdraw,
+    // and the vertices, uvs and normals in the order the faces use them, see meshopt.h
+    void optimize(int cache_size = 16);
+
+    // average cache miss ratio of level 0
+    float acmr(int cache_size = 16);
+
+    bool write_obj(const char *filename);
+
+    const std::vector<Vec2i> &edges();
+
+    Vec2i corner(int i);
+
+    // Replaces the mesh with nfaces triangles of the vertices at faces[3 * i] to faces[3 * i + 2], every vertex with
+    // its own uv and normal, and the textures with the ones of materials, which are shared. The edges are built on
+    // first use. One level of detail.
+    void assign(const Model &materials, int nverts, const Vec3f *verts, const Vec2f *uv, const Vec3f *norms,
+                int nfaces, const int *faces);
 };
 
 #endif //__MODEL_H__
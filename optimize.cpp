@@ -0,0 +1,38 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include "model.h"
+
+// Reorders the triangles and vertices of every model for the vertex cache and for overdraw,
+// reports the ACMR before and after, and optionally writes the optimized obj files to a directory.
+int main(int argc, char **argv) {
+    std::string outdir;
+    int first = 1;
+    if (argc > 2 && !strcmp(argv[1], "-o")) {
+        outdir = argv[2];
+        first = 3;
+    }
+    if (first >= argc) {
+        std::cerr << "Usage: " << argv[0] << " [-o outdir] obj/model.obj..." << std::endl;
+        return 1;
+    }
+    int errors = 0;
+    for (int m = first; m < argc; m++) {
+        Model model(argv[m]);
+        if (!model.nverts()) {
+            std::cerr << "can't load model " << argv[m] << "\n";
+            errors++;
+            continue;
+        }
+        float before = model.acmr();
+        model.optimize();
+        std::cout << argv[m] << ": ACMR " << before << " -> " << model.acmr() << std::endl;
+        if (!outdir.empty()) {
+            std::string name(argv[m]);
+            size_t slash = name.find_last_of('/');
+            std::string path = outdir + "/" + (slash == std::string::npos ? name : name.substr(slash + 1));
+            if (!model.write_obj(path.c_str())) errors++;
+        }
+    }
+    return errors ? 1 : 0;
+}
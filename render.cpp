@@ -0,0 +1,318 @@
+#include <cstring>
+#include <iostream>
+#include "render.h"
+#include "shader.h"
+#include "trace.h"
+
+std::shared_ptr<Model> ModelCache::get(const std::string &filename) {
+    TRACE_SCOPE("model cache");
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = models.find(filename);
+        if (it != models.end()) return it->second;
+    }
+    // loaded without the lock, so other jobs keep hitting the cache meanwhile
+    std::shared_ptr<Model> model = std::make_shared<Model>(filename.c_str(), storage);
+    if (!model->nverts()) return nullptr;
+    std::lock_guard<std::mutex> lock(mutex);
+    return models.emplace(filename, model).first->second;
+}
+
+namespace {
+    const std::map<std::string, GL::RendererType> renderers = {
+            {"vertex",           GL::VERTEX},
+            {"line",             GL::LINE},
+            {"triangle",         GL::TRIANGLE},
+            {"triangle_colored", GL::TRIANGLE_COLORED},
+            {"depth",            GL::DEPTH},
+    };
+
+    const std::map<std::string, GL::ShadingRate> shading_rates = {
+            {"auto", GL::SHADING_AUTO},
+            {"1x1",  GL::SHADING_1X1},
+            {"2x2",  GL::SHADING_2X2},
+            {"4x4",  GL::SHADING_4X4},
+    };
+
+    const std::map<std::string, DepthBuffer::Format> depth_formats = {
+            {"float32", DepthBuffer::FLOAT32},
+            {"unorm24", DepthBuffer::UNORM24},
+            {"unorm16", DepthBuffer::UNORM16},
+    };
+
+    template<typename T>
+    bool parse_name(const std::map<std::string, T> &names, const std::string &name, T &value) {
+        auto it = names.find(name);
+        if (it == names.end()) return false;
+        value = it->second;
+        return true;
+    }
+
+    template<typename T>
+    std::string name_of(const std::map<std::string, T> &names, T value) {
+        for (auto &it : names) {
+            if (it.second == value) return it.first;
+        }
+        return "";
+    }
+}
+
+bool parse_renderer(const std::string &name, GL::RendererType &renderer) {
+    return parse_name(renderers, name, renderer);
+}
+
+bool parse_shading_rate(const std::string &name, GL::ShadingRate &rate) {
+    return parse_name(shading_rates, name, rate);
+}
+
+bool parse_depth_format(const std::string &name, DepthBuffer::Format &format) {
+    return parse_name(depth_formats, name, format);
+}
+
+std::string renderer_name(GL::RendererType renderer) {
+    return name_of(renderers, renderer);
+}
+
+std::string shading_rate_name(GL::ShadingRate rate) {
+    return name_of(shading_rates, rate);
+}
+
+std::string depth_format_name(DepthBuffer::Format format) {
+    return name_of(depth_formats, format);
+}
+
+Matrix view_projection(const RenderJob &job) {
+    auto V = lookat(job.eye, job.center, job.up);
+//    auto P = projection((eye - center).norm());
+    auto len = 1 - 1 / (job.eye - job.center).norm();
+    auto P = frustum(-len, len, -len, len, (job.eye - job.center).norm() - 1, (job.eye - job.center).norm() + 1);
+    return P * V;
+}
+
+namespace {
+    // the target and the settings of the job
+    GL &begin_frame(const RenderJob &job, TGAImage &framebuffer, RenderContext &context) {
+        context.arena.reset();
+        GL &gl = context.gl;
+        if (gl.zbuffer.format() != job.depth_format) gl.glDepthFormat(job.depth_format);
+        if (job.renderer == GL::DEPTH) {
+            gl.glTarget(job.width, job.height);
+        } else {
+            gl.glTarget(&framebuffer);
+        }
+        // a region keeps the viewport of its frame, only its pixels are written
+        const int width = job.frame_width ? job.frame_width : job.width;
+        const int height = job.frame_height ? job.frame_height : job.height;
+        gl.glViewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
+        gl.glRegion(job.frame_x, job.frame_y, width, height);
+        gl.glRenderer(job.renderer);
+        gl.glZPrepass(job.zprepass);
+        gl.glShadingRate(job.shading, job.shading_detail);
+        return gl;
+    }
+
+    void end_frame(const RenderJob &job, TGAImage &framebuffer, GL &gl) {
+        if (job.renderer == GL::DEPTH) { // grayscale depth, black where nothing was drawn
+            for (int y = 0; y < job.height; y++) {
+                for (int x = 0; x < job.width; x++) {
+                    float z = gl.zbuffer.get(x, y);
+                    auto v = static_cast<unsigned char>(z > 0.f && z < 1.f ? z * 255 : 0);
+                    framebuffer.set(x, y, TGAColor(v, v, v));
+                }
+            }
+        }
+    }
+}
+
+void glRender(const std::vector<Model *> &models, const RenderJob &job, TGAImage &framebuffer,
+              RenderContext &context) {
+    TRACE_SCOPE("render");
+    GL &gl = begin_frame(job, framebuffer, context);
+    Matrix vp = view_projection(job);
+
+    BumpShader *shaders = context.arena.make_array<BumpShader>(models.size()); // alive until glFlush()
+    for (size_t i = 0; i < models.size(); i++) {
+        shaders[i].set_mvp(vp);
+        shaders[i].set_model(models[i]);
+
+        gl.glShader(&shaders[i]);
+        if (job.instances.empty()) {
+            gl.glDraw();
+        } else {
+            gl.glDrawInstanced(job.instances.data(), (int) job.instances.size());
+        }
+    }
+    gl.glFlush();
+    end_frame(job, framebuffer, gl);
+}
+
+void glRender(const std::vector<MeshStream *> &streams, const RenderJob &job, TGAImage &framebuffer,
+              RenderContext &context) {
+    TRACE_SCOPE("streamed render");
+    GL &gl = begin_frame(job, framebuffer, context);
+    gl.glZPrepass(false);
+    Matrix vp = view_projection(job);
+    BumpShader *shader = context.arena.make_array<BumpShader>(1);
+    shader->set_mvp(vp);
+    gl.glShader(shader);
+    for (MeshStream *stream : streams) stream->start(vp); // every loader reads ahead meanwhile
+    for (MeshStream *stream : streams) {
+        while (Model *chunk = stream->next()) {
+            shader->set_model(chunk);
+            gl.glDraw();
+            stream->release(chunk);
+        }
+    }
+    end_frame(job, framebuffer, gl);
+}
+
+void glRender(const std::vector<Model *> &models, const RenderJob &job, TGAImage &framebuffer) {
+    RenderContext context;
+    glRender(models, job, framebuffer, context);
+}
+
+namespace {
+    // every pixel of frame takes the one of coarse its block of stride x stride pixels falls in
+    void scale_up(TGAImage &coarse, TGAImage &frame, int stride) {
+        const int bytespp = frame.get_bytespp(), width = frame.get_width(), height = frame.get_height();
+        const size_t row = static_cast<size_t>(width) * bytespp;
+        for (int y = 0; y < height; y += stride) {
+            const unsigned char *src = coarse.buffer() + (y / stride) * coarse.get_width() * bytespp;
+            unsigned char *dst = frame.buffer() + y * row;
+            for (int x = 0; x < width; src += bytespp) {
+                for (int k = 0; k < stride && x < width; k++, x++) memcpy(dst + x * bytespp, src, bytespp);
+            }
+            for (int k = 1; k < stride && y + k < height; k++) memcpy(dst + k * row, dst, row); // the rest of the block
+        }
+    }
+
+    // models, or the streams of the context
+    void draw_frame(const std::vector<Model *> &models, const RenderJob &job, TGAImage &framebuffer,
+                    RenderContext &context) {
+        if (job.stream) {
+            glRender(context.streamed, job, framebuffer, context);
+        } else {
+            glRender(models, job, framebuffer, context);
+        }
+    }
+
+    // at job.supersample times the size, then box filtered into framebuffer
+    void render_frame(const std::vector<Model *> &models, const RenderJob &job, TGAImage &framebuffer,
+                      RenderContext &context) {
+        if (job.supersample <= 1) {
+            draw_frame(models, job, framebuffer, context);
+            return;
+        }
+        RenderJob large = job;
+        large.width *= job.supersample;
+        large.height *= job.supersample;
+        large.frame_x *= job.supersample, large.frame_y *= job.supersample;
+        large.frame_width *= job.supersample, large.frame_height *= job.supersample;
+        TGAImage &image = context.supersampled;
+        if (image.get_width() != large.width || image.get_height() != large.height ||
+            image.get_bytespp() != framebuffer.get_bytespp()) {
+            image = TGAImage(large.width, large.height, framebuffer.get_bytespp());
+        } else {
+            image.clear();
+        }
+        draw_frame(models, large, image, context);
+        image.scale_to(framebuffer, TGAImage::BOX);
+    }
+}
+
+void glRenderProgressive(const std::vector<Model *> &models, const RenderJob &job, TGAImage &framebuffer,
+                         RenderContext &context, const ProgressCallback &on_pass) {
+    TRACE_SCOPE("progressive render");
+    for (int stride : {8, 4}) {
+        RenderJob pass = job;
+        pass.width = (job.width + stride - 1) / stride;
+        pass.height = (job.height + stride - 1) / stride;
+        pass.frame_x /= stride, pass.frame_y /= stride, pass.frame_width /= stride, pass.frame_height /= stride;
+        TGAImage &coarse = context.coarse;
+        if (coarse.get_width() != pass.width || coarse.get_height() != pass.height ||
+            coarse.get_bytespp() != framebuffer.get_bytespp()) {
+            coarse = TGAImage(pass.width, pass.height, framebuffer.get_bytespp());
+        } else {
+            coarse.clear();
+        }
+        glRender(models, pass, coarse, context);
+        scale_up(coarse, framebuffer, stride);
+        if (!on_pass(framebuffer, stride)) return;
+    }
+    framebuffer.clear();
+    render_frame(models, job, framebuffer, context);
+    on_pass(framebuffer, 1);
+}
+
+namespace {
+    // into context.loaded and context.models, the previous job's are released. The streams of a job with stream
+    // go to context.streamed instead and stay open in the context for the next jobs.
+    bool load_models(const RenderJob &job, ModelCache &cache, RenderContext &context) {
+        context.loaded.clear();
+        context.models.clear();
+        context.streamed.clear();
+        for (auto &obj : job.objs) {
+            if (job.stream) {
+                std::unique_ptr<MeshStream> &stream = context.streams[obj];
+                if (!stream) {
+                    stream.reset(new MeshStream());
+                    if (!stream->open(obj.c_str())) {
+                        stream.reset();
+                        return false;
+                    }
+                }
+                context.streamed.push_back(stream.get());
+                continue;
+            }
+            std::shared_ptr<Model> model = cache.get(obj);
+            if (!model) {
+                std::cerr << "can't load model " << obj << "\n";
+                return false;
+            }
+            context.models.push_back(model.get());
+            context.loaded.push_back(std::move(model));
+        }
+        return true;
+    }
+}
+
+// the framebuffer rows go bottom up, which is what a bottom-left origin TGA stores, so there is nothing to flip
+bool glRender(const RenderJob &job, ModelCache &cache, RenderContext &context) {
+    if (!load_models(job, cache, context)) return false;
+    TGAImage &framebuffer = context.framebuffer;
+    if (framebuffer.get_width() != job.width || framebuffer.get_height() != job.height) {
+        framebuffer = TGAImage(job.width, job.height, TGAImage::RGB);
+    } else {
+        framebuffer.clear();
+    }
+    render_frame(context.models, job, framebuffer, context);
+    return job.output.empty() || framebuffer.write_tga_file(job.output.data(), true, true);
+}
+
+bool glRenderProgressive(const RenderJob &job, ModelCache &cache, RenderContext &context,
+                         const ProgressCallback &on_pass) {
+    if (job.stream) { // only the final frame, the coarse passes would read the chunks as often
+        if (!glRender(job, cache, context)) return false;
+        on_pass(context.framebuffer, 1);
+        return true;
+    }
+    if (!load_models(job, cache, context)) return false;
+    TGAImage &framebuffer = context.framebuffer;
+    if (framebuffer.get_width() != job.width || framebuffer.get_height() != job.height) {
+        framebuffer = TGAImage(job.width, job.height, TGAImage::RGB);
+    }
+    bool written = true;
+    glRenderProgressive(context.models, job, framebuffer, context, [&](TGAImage &frame, int stride) {
+        written = frame.write_tga_file(job.output.data(), true, true);
+        return written && on_pass(frame, stride);
+    });
+    return written;
+}
+
+bool glRender(const RenderJob &job, ModelCache &cache, FrameWriter &writer, RenderContext &context) {
+    if (!load_models(job, cache, context)) return false;
+    std::unique_ptr<TGAImage> framebuffer = writer.acquire(job.width, job.height, TGAImage::RGB);
+    render_frame(context.models, job, *framebuffer, context);
+    writer.submit(std::move(framebuffer), job.output);
+    return true;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "arena.h"
+#include "gl.h"
+#include "framewriter.h"
+#include "meshstream.h"
+
+struct RenderJob {
+    std::vector<std::string> objs;
+    int width = 800;
+    int height = 800;
+    Vec3f eye = {1, 1, 3};
+    Vec3f center = {0, 0, 0};
+    Vec3f up = {0, 1, 0};
+    GL::RendererType renderer = GL::TRIANGLE_COLORED;
+    bool zprepass = false;
+    bool progressive = false; // see glRenderProgressive()
+    GL::ShadingRate shading = GL::SHADING_1X1;
+    float shading_detail = 1.f; // texels per shading sample at SHADING_AUTO, see GL::glShadingRate()
+    int supersample = 1; // rendered that many times larger and box filtered down, by the file writing glRender()s
+    DepthBuffer::Format depth_format = DepthBuffer::FLOAT32;
+    bool stream = false; // the objs drawn a chunk at a time from their .chunks files, see MeshStream
+    std::vector<Matrix> instances; // object to world transforms, every model is drawn once per transform if any
+    // A region of a larger frame: the framebuffer is the width x height pixels from (frame_x, frame_y) of a
+    // frame_width x frame_height frame, exactly as in that frame, see GL::glRegion(). 0 x 0 is a frame of its own.
+    int frame_x = 0, frame_y = 0, frame_width = 0, frame_height = 0;
+    std::string output;
+};
+
+// keeps every loaded model (and its textures) in memory, can be shared between threads
+class ModelCache {
+public:
+    explicit ModelCache(Model::TextureStorage storage = Model::RAW_TEXTURES) : storage(storage) {}
+
+    std::shared_ptr<Model> get(const std::string &filename);
+
+private:
+    Model::TextureStorage storage;
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<Model> > models;
+};
+
+// Everything a frame needs besides the models, kept from one frame to the next: once the first frames have sized
+// it, a frame of the same size and scene renders without any heap allocation. One per thread.
+struct RenderContext {
+    GL gl{0, 0};
+    Arena arena;          // what lives for one frame only (the shaders), reset when a frame starts
+    TGAImage framebuffer; // of glRender(job, cache, context)
+    TGAImage coarse;      // the low resolution passes of glRenderProgressive()
+    TGAImage supersampled;
+    std::vector<std::shared_ptr<Model> > loaded;
+    std::vector<Model *> models;
+    std::map<std::string, std::unique_ptr<MeshStream> > streams; // of the jobs with stream, by obj
+    std::vector<MeshStream *> streamed;                           // the current job's
+};
+
+bool parse_renderer(const std::string &name, GL::RendererType &renderer);
+
+// 1x1, 2x2, 4x4 or auto
+bool parse_shading_rate(const std::string &name, GL::ShadingRate &rate);
+
+bool parse_depth_format(const std::string &name, DepthBuffer::Format &format);
+
+// the names the parse functions above take
+std::string renderer_name(GL::RendererType renderer);
+
+std::string shading_rate_name(GL::ShadingRate rate);
+
+std::string depth_format_name(DepthBuffer::Format format);
+
+// the camera of the job, world to clip coordinates
+Matrix view_projection(const RenderJob &job);
+
+void glRender(const std::vector<Model *> &models, const RenderJob &job, TGAImage &framebuffer,
+              RenderContext &context);
+
+// with a context of its own, for one-off frames
+void glRender(const std::vector<Model *> &models, const RenderJob &job, TGAImage &framebuffer);
+
+// Draws the chunks of every stream in the view frustum as the loaders read them, so the frame starts before the
+// meshes are read and never holds them whole. A chunk's Model is reused once drawn, so there is no z prepass and
+// the instances of the job are ignored.
+void glRender(const std::vector<MeshStream *> &streams, const RenderJob &job, TGAImage &framebuffer,
+              RenderContext &context);
+
+// the frame stays in context.framebuffer, it is written to job.output unless that is empty
+bool glRender(const RenderJob &job, ModelCache &cache, RenderContext &context);
+
+// Called after every pass of a progressive render with the full size frame and the stride of the pass,
+// stride 1 is the last one and its frame the final one. Returns false to stop there.
+using ProgressCallback = std::function<bool(TGAImage &frame, int stride)>;
+
+// Time to first image: renders the job at 1/8, 1/4 and then full resolution. A coarse pass costs 1/64 and
+// 1/16 of the pixels and draws coarser levels of detail, its frame is scaled up with one pixel per block, so the
+// first frame comes over 10 times sooner than a direct render and all the passes cost less than 1.3 of it. The
+// final frame is the one glRender(job, cache, context) gives, supersampled as well, nothing shaded at a lower
+// resolution is reused for it.
+void glRenderProgressive(const std::vector<Model *> &models, const RenderJob &job, TGAImage &framebuffer,
+                         RenderContext &context, const ProgressCallback &on_pass);
+
+// writes the output file after every pass
+bool glRenderProgressive(const RenderJob &job, ModelCache &cache, RenderContext &context,
+                         const ProgressCallback &on_pass);
+
+// returns once the frame is rendered and queued, write errors are reported by writer.flush()
+bool glRender(const RenderJob &job, ModelCache &cache, FrameWriter &writer, RenderContext &context);
@@ -0,0 +1,75 @@
+#include "retained.h"
+#include "render.h"
+#include "shader.h"
+#include "trace.h"
+
+RetainedScene::RetainedScene(int width, int height) : framebuffer(width, height, TGAImage::RGB), gl(&framebuffer),
+                                                      vp(), everything(true), objects() {
+    gl.glViewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
+    gl.glRetained(true);
+    set_camera(Vec3f(1, 1, 3), Vec3f(0, 0, 0), Vec3f(0, 1, 0));
+}
+
+RetainedScene::~RetainedScene() = default;
+
+// the camera of glRender()
+void RetainedScene::set_camera(Vec3f eye, Vec3f center, Vec3f up) {
+    RenderJob job;
+    job.eye = eye;
+    job.center = center;
+    job.up = up;
+    vp = view_projection(job);
+    everything = true;
+}
+
+int RetainedScene::add(Model *model, const Matrix &transform) {
+    objects.push_back({model, transform, Vec3f(1, 1, 1), std::unique_ptr<BumpShader>(new BumpShader()), TileRect(),
+                       true});
+    objects.back().shader->set_model(model);
+    return static_cast<int>(objects.size()) - 1;
+}
+
+void RetainedScene::set_transform(int object, const Matrix &transform) {
+    objects[object].transform = transform;
+    objects[object].changed = true;
+}
+
+void RetainedScene::set_tint(int object, Vec3f tint) {
+    objects[object].tint = tint;
+    objects[object].changed = true;
+}
+
+int RetainedScene::update() {
+    TRACE_SCOPE("retained update");
+    if (everything) gl.glRetained(true);
+    for (auto &o : objects) {
+        if (!o.changed) continue;
+        gl.glInvalidate(o.tiles);
+        gl.glInvalidate(gl.glScreenTiles(vp * o.transform, o.model));
+    }
+    int dirty = gl.glDirtyCount();
+    if (!dirty) return 0;
+    gl.glClearDirty();
+    for (auto &o : objects) {
+        Matrix mvp = vp * o.transform;
+        bool moved = o.changed || everything;
+        TileRect bounds = moved ? gl.glScreenTiles(mvp, o.model) : o.tiles;
+        o.changed = false;
+        if (moved) o.tiles = TileRect();
+        if (!gl.glDirty(bounds)) continue;
+        float tint[3] = {o.tint.x, o.tint.y, o.tint.z};
+        o.shader->set_mvp(mvp);
+        o.shader->set_instance(o.transform, tint, 3);
+        gl.drawnTiles = TileRect();
+        gl.glShader(o.shader.get());
+        gl.glDraw();
+        if (moved) o.tiles = gl.drawnTiles; // all of it, the whole screen box was dirty
+    }
+    gl.glValidate();
+    everything = false;
+    return dirty;
+}
+
+TGAImage &RetainedScene::image() {
+    return framebuffer;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "gl.h"
+
+struct BumpShader;
+
+// A scene kept from one frame to the next, for a camera that stays put while a few objects move or change.
+// update() clears and redraws only the tiles the changed objects covered in the last frame or may cover now,
+// and there only the objects overlapping them, so its cost follows the change and not the scene size.
+// The first update() draws everything, so does the first one after set_camera().
+class RetainedScene {
+public:
+    RetainedScene(int width, int height);
+
+    ~RetainedScene();
+
+    void set_camera(Vec3f eye, Vec3f center, Vec3f up);
+
+    // returns the object's index, the model must outlive the scene
+    int add(Model *model, const Matrix &transform = Matrix::identity());
+
+    void set_transform(int object, const Matrix &transform);
+
+    // rgb in [0, 1]
+    void set_tint(int object, Vec3f tint);
+
+    // returns the number of tiles redrawn
+    int update();
+
+    TGAImage &image();
+
+private:
+    struct Object {
+        Model *model;
+        Matrix transform;
+        Vec3f tint;
+        std::unique_ptr<BumpShader> shader;
+        TileRect tiles; // covered in the last frame
+        bool changed;
+    };
+
+    TGAImage framebuffer;
+    GL gl;
+    Matrix vp;
+    bool everything;
+    std::vector<Object> objects;
+};
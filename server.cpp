@@ -0,0 +1,434 @@
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <csignal>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.h"
+#include "render.h"
+#include "trace.h"
+
+namespace {
+    const size_t MAX_PIXELS = size_t(1) << 26; // rendered, supersampling included: 8192 x 8192, about 500MB
+    const int MAX_SIZE = 1 << 16;              // of a frame side
+    const int MAX_SUPERSAMPLE = 16;            // so that the pixel count below fits in 64 bits, the sides in an int
+    const size_t MAX_LINE = 1 << 16;           // a client that sends more without a newline is dropped
+
+    struct Job {
+        int fd;
+        std::string line;
+        bool remote;
+    };
+
+    // the lines waiting for a worker, at most one per connection so that its replies stay in order
+    struct JobQueue {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<Job> jobs;
+        bool closed = false;
+
+        void push(Job job) {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+            ready.notify_one();
+        }
+
+        // false once the queue is closed, the jobs still waiting are dropped
+        bool pop(Job &job) {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this] { return closed || !jobs.empty(); });
+            if (closed) return false;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            return true;
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            ready.notify_all();
+        }
+    };
+
+    // one connection of the poll loop, its lines are read there and only its job goes to a worker
+    struct Client {
+        std::string buffer;  // received, not a whole line yet
+        bool busy = false;   // a worker has its job, the connection is not polled meanwhile
+        bool remote = false; // over TCP: no file written, no shutdown
+    };
+
+    bool parse_vec(const std::string &s, Vec3f &v) {
+        char c1, c2;
+        std::istringstream iss(s);
+        return (iss >> v.x >> c1 >> v.y >> c2 >> v.z) && c1 == ',' && c2 == ',';
+    }
+
+    bool parse_int(const std::string &s, int &value, int max) {
+        char *end;
+        long v = std::strtol(s.c_str(), &end, 10);
+        if (*end || v <= 0 || v > max) return false;
+        value = static_cast<int>(v);
+        return true;
+    }
+
+    bool parse_region(const std::string &s, int region[4]) {
+        char c[3];
+        std::istringstream iss(s);
+        return (iss >> region[0] >> c[0] >> region[1] >> c[1] >> region[2] >> c[2] >> region[3]) &&
+               c[0] == ',' && c[1] == ',' && c[2] == ',';
+    }
+
+    bool parse_job(const std::string &line, RenderJob &job, std::string &error) {
+        std::istringstream iss(line);
+        std::string token;
+        iss >> token;
+        if (token != "render") {
+            error = "unknown command " + token;
+            return false;
+        }
+        job.output = "framebuffer.tga";
+        int region[4] = {0, 0, 0, 0};
+        while (iss >> token) {
+            size_t eq = token.find('=');
+            std::string key = token.substr(0, eq);
+            std::string value = eq == std::string::npos ? "" : token.substr(eq + 1);
+            bool ok = true;
+            if (key == "obj") job.objs.push_back(value);
+            else if (key == "out") job.output = value;
+            else if (key == "width") ok = parse_int(value, job.width, MAX_SIZE);
+            else if (key == "height") ok = parse_int(value, job.height, MAX_SIZE);
+            else if (key == "mode") ok = parse_renderer(value, job.renderer);
+            else if (key == "zprepass") job.zprepass = value != "0";
+            else if (key == "progressive") job.progressive = value != "0";
+            else if (key == "shading") ok = parse_shading_rate(value, job.shading);
+            else if (key == "detail") ok = (job.shading_detail = std::atof(value.c_str())) > 0;
+            else if (key == "supersample") ok = parse_int(value, job.supersample, MAX_SUPERSAMPLE);
+            else if (key == "depth") ok = parse_depth_format(value, job.depth_format);
+            else if (key == "stream") job.stream = value != "0";
+            else if (key == "eye") ok = parse_vec(value, job.eye);
+            else if (key == "center") ok = parse_vec(value, job.center);
+            else if (key == "up") ok = parse_vec(value, job.up);
+            else if (key == "region") ok = parse_region(value, region);
+            else ok = false;
+            if (!ok || value.empty()) {
+                error = "bad argument " + token;
+                return false;
+            }
+        }
+        if (job.objs.empty()) {
+            error = "no obj given";
+            return false;
+        }
+        if (static_cast<uint64_t>(job.width) * job.height * job.supersample * job.supersample > MAX_PIXELS) {
+            error = "frame too large, at most " + std::to_string(MAX_PIXELS) + " pixels supersampling included";
+            return false;
+        }
+        if (region[2] || region[3]) { // once width and height are known, whatever the order of the keys
+            if (region[0] < 0 || region[1] < 0 || region[2] <= 0 || region[3] <= 0 || region[0] > job.width ||
+                region[1] > job.height || region[2] > job.width - region[0] || region[3] > job.height - region[1]) {
+                error = "region out of the frame";
+                return false;
+            }
+            job.frame_width = job.width, job.frame_height = job.height;
+            job.frame_x = region[0], job.frame_y = region[1], job.width = region[2], job.height = region[3];
+        }
+        return true;
+    }
+
+    bool send_all(int fd, const char *data, size_t size) {
+        for (size_t sent = 0; sent < size;) {
+            ssize_t n = send(fd, data + sent, size - sent, 0);
+            if (n <= 0) return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    bool send_line(int fd, const std::string &line) {
+        std::string msg = line + "\n";
+        return send_all(fd, msg.data(), msg.size());
+    }
+
+    // from the poll thread, which must not wait on a client: false when the line does not fit in the socket buffer
+    bool send_line_now(int fd, const std::string &line) {
+        std::string msg = line + "\n";
+        return send(fd, msg.data(), msg.size(), MSG_DONTWAIT) == static_cast<ssize_t>(msg.size());
+    }
+
+    bool send_pixels(int fd, TGAImage &frame) {
+        const int bytespp = frame.get_bytespp();
+        return send_line(fd, "pixels " + std::to_string(frame.get_width()) + " " +
+                             std::to_string(frame.get_height()) + " " + std::to_string(bytespp)) &&
+               send_all(fd, reinterpret_cast<const char *>(frame.buffer()),
+                        static_cast<size_t>(frame.get_width()) * frame.get_height() * bytespp);
+    }
+
+    // host:port, a unix socket path when there is no ':'
+    bool split_address(const std::string &address, std::string &host, std::string &port) {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos) return false;
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+        return true;
+    }
+
+    int listen_on(const std::string &address) {
+        std::string host, port;
+        if (!split_address(address, host, port)) {
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (address.size() >= sizeof(addr.sun_path)) {
+                std::cerr << "socket path too long " << address << "\n";
+                return -1;
+            }
+            strcpy(addr.sun_path, address.c_str());
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            unlink(address.c_str());
+            if (fd < 0 || bind(fd, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+                std::cerr << "can't listen on " << address << ": " << strerror(errno) << "\n";
+                if (fd >= 0) close(fd);
+                return -1;
+            }
+            return fd;
+        }
+        addrinfo hints, *info;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM; // no AI_PASSIVE: without a host, the loopback interface only
+        int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &info);
+        if (err) {
+            std::cerr << "can't resolve " << address << ": " << gai_strerror(err) << "\n";
+            return -1;
+        }
+        int fd = -1, on = 1;
+        for (addrinfo *a = info; a && fd < 0; a = a->ai_next) { // ::1 and 127.0.0.1, one may be disabled
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (fd >= 0 && (bind(fd, a->ai_addr, a->ai_addrlen) < 0 || listen(fd, 64) < 0)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(info);
+        if (fd < 0) std::cerr << "can't listen on " << address << ": " << strerror(errno) << "\n";
+        return fd;
+    }
+
+    // the reply to one line, false once the client is gone. A remote client gets no file written here.
+    bool answer(int fd, const std::string &line, bool remote, ModelCache &cache, RenderContext &context) {
+        if (!line.compare(0, 6, "trace ")) {
+            if (remote) return send_line(fd, "error no trace over TCP");
+            std::string path = line.substr(6);
+            return send_line(fd, trace_dump(path.c_str()) ? "ok " + path : "error no trace written");
+        }
+        TRACE_SCOPE("job");
+        RenderJob job;
+        std::string error;
+        if (!parse_job(line, job, error)) return send_line(fd, "error " + error);
+        if (remote && job.output != "-") return send_line(fd, "error only out=- over TCP");
+        if (remote && job.stream) return send_line(fd, "error no stream over TCP, it writes the .chunks files");
+        bool alive = true;
+        if (job.output == "-") { // the pixels go back on the socket
+            job.output.clear();
+            if (!glRender(job, cache, context)) return send_line(fd, "error render failed, see the server log");
+            return send_pixels(fd, context.framebuffer);
+        }
+        if (job.progressive ? !glRenderProgressive(job, cache, context, [&](TGAImage &, int stride) {
+            return stride == 1 || (alive = send_line(fd, "progress " + std::to_string(stride) + " " + job.output));
+        }) : !glRender(job, cache, context)) {
+            return alive && send_line(fd, "error render failed, see the server log");
+        }
+        return send_line(fd, "ok " + job.output);
+    }
+}
+
+int serve(const char *address, int workers, Model::TextureStorage storage) {
+    int listen_fd = listen_on(address);
+    if (listen_fd < 0) return 1;
+    std::string host, port;
+    const bool tcp = split_address(address, host, port);
+    int wake[2]; // the workers write the connection of each job answered, the poll loop reads them
+    if (pipe(wake) < 0) {
+        std::cerr << "can't create a pipe: " << strerror(errno) << "\n";
+        close(listen_fd);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // a client that hangs up must not kill the server
+
+    ModelCache cache(storage);
+    JobQueue queue;
+    std::vector<std::thread> pool;
+    if (workers <= 0) workers = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < workers; i++) {
+        pool.emplace_back([&] {
+            std::unique_ptr<RenderContext> context(new RenderContext()); // the frames of this worker reuse its memory
+            Job job;
+            while (queue.pop(job)) {
+                bool alive;
+                try {
+                    alive = answer(job.fd, job.line, job.remote, cache, *context);
+                } catch (const std::exception &e) { // out of memory most likely, the server goes on
+                    std::cerr << "job failed: " << e.what() << "\n";
+                    context.reset(new RenderContext());
+                    alive = send_line(job.fd, std::string("error ") + e.what());
+                }
+                int reply[2] = {job.fd, alive};
+                if (write(wake[1], reply, sizeof(reply)) != sizeof(reply)) {
+                    std::cerr << "can't wake up the server: " << strerror(errno) << "\n";
+                }
+            }
+        });
+    }
+    std::cerr << "# serving on " << address << " with " << workers << " workers" << std::endl;
+
+    std::map<int, Client> clients;
+    bool stopping = false;
+    auto drop = [&](int fd) {
+        close(fd);
+        clients.erase(fd);
+    };
+    // the next whole line of a connection to the workers, false when the client has to go
+    auto next_line = [&](int fd, Client &client) {
+        size_t nl;
+        while (!client.busy && (nl = client.buffer.find('\n')) != std::string::npos) {
+            std::string line = client.buffer.substr(0, nl);
+            client.buffer.erase(0, nl + 1);
+            if (line.empty()) continue;
+            if (line == "shutdown" && client.remote) {
+                if (!send_line_now(fd, "error no shutdown over TCP")) return false; // a client that doesn't read
+                continue;
+            }
+            if (line == "shutdown") {
+                send_line_now(fd, "ok");
+                stopping = true;
+                return true;
+            }
+            queue.push({fd, line, client.remote});
+            client.busy = true;
+        }
+        if (client.busy || client.buffer.size() <= MAX_LINE) return true;
+        send_line_now(fd, "error line too long");
+        return false;
+    };
+    std::vector<pollfd> polled;
+    while (!stopping) {
+        polled.assign({{listen_fd, POLLIN, 0}, {wake[0], POLLIN, 0}});
+        for (auto &c : clients) {
+            if (!c.second.busy) polled.push_back({c.first, POLLIN, 0});
+        }
+        if (poll(polled.data(), polled.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "can't poll: " << strerror(errno) << "\n";
+            break;
+        }
+        for (size_t i = 2; i < polled.size(); i++) {
+            if (!polled[i].revents) continue;
+            int fd = polled[i].fd;
+            char chunk[4096];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            Client &client = clients[fd];
+            if (n > 0) client.buffer.append(chunk, static_cast<size_t>(n));
+            if (n <= 0 || !next_line(fd, client)) drop(fd);
+        }
+        if (polled[1].revents) { // the connections are polled again once their job is answered
+            int reply[2];
+            if (read(wake[0], reply, sizeof(reply)) == sizeof(reply)) {
+                Client &client = clients[reply[0]];
+                client.busy = false;
+                if (!reply[1] || !next_line(reply[0], client)) drop(reply[0]);
+            }
+        }
+        if (polled[0].revents) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0) clients[fd].remote = tcp;
+        }
+    }
+
+    // the workers finish their job, blocked on a client or not, the jobs waiting are dropped
+    queue.close();
+    for (auto &c : clients) shutdown(c.first, SHUT_RDWR);
+    for (auto &t : pool) t.join();
+    for (auto &c : clients) close(c.first);
+    close(wake[0]);
+    close(wake[1]);
+    close(listen_fd);
+    if (!tcp) unlink(address);
+    return 0;
+}
+
+int connect_to(const std::string &address) {
+    std::string host, port;
+    if (!split_address(address, host, port)) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (sockaddr *) &addr, sizeof(addr)) < 0) {
+            std::cerr << "can't connect to " << address << ": " << strerror(errno) << "\n";
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    addrinfo hints, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    // without a host the loopback interface, as listen_on()
+    int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &info);
+    if (err) {
+        std::cerr << "can't resolve " << address << ": " << gai_strerror(err) << "\n";
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo *a = info; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(info);
+    if (fd < 0) {
+        std::cerr << "can't connect to " << address << ": " << strerror(errno) << "\n";
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // a job line is one small packet
+    return fd;
+}
+
+std::string format_job(const RenderJob &job) {
+    std::ostringstream line;
+    line.precision(9); // every float as it was
+    line << "render";
+    for (auto &obj : job.objs) line << " obj=" << obj;
+    line << " out=" << (job.output.empty() ? "-" : job.output);
+    const bool region = job.frame_width > 0;
+    line << " width=" << (region ? job.frame_width : job.width) << " height=" << (region ? job.frame_height : job.height);
+    line << " mode=" << renderer_name(job.renderer);
+    line << " eye=" << job.eye.x << "," << job.eye.y << "," << job.eye.z;
+    line << " center=" << job.center.x << "," << job.center.y << "," << job.center.z;
+    line << " up=" << job.up.x << "," << job.up.y << "," << job.up.z;
+    line << " zprepass=" << job.zprepass << " progressive=" << job.progressive;
+    line << " shading=" << shading_rate_name(job.shading) << " detail=" << job.shading_detail;
+    line << " supersample=" << job.supersample << " depth=" << depth_format_name(job.depth_format);
+    line << " stream=" << job.stream;
+    if (region) line << " region=" << job.frame_x << "," << job.frame_y << "," << job.width << "," << job.height;
+    return line.str();
+}
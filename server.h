@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include "model.h"
+#include "render.h"
+
+// Long running render server on a unix domain socket, or on TCP when the address is host:port. An empty host
+// listens on the loopback interface only, 0.0.0.0 (or the address of an interface) has to be given to listen on
+// the network. Every line received is one job:
+//   render obj=<file.obj> [obj=...] [out=<file.tga>|-] [width=800] [height=800] [mode=triangle_colored]
+//          [eye=1,1,3] [center=0,0,0] [up=0,1,0] [zprepass=0] [progressive=0] [shading=1x1|2x2|4x4|auto]
+//          [detail=1] [supersample=1] [depth=float32|unorm24|unorm16] [stream=0] [region=x,y,width,height]
+// and is answered by one line, "ok <output path>" or "error <reason>". With progressive=1 the output is written
+// at 1/8 and 1/4 resolution first, each announced by a "progress <stride> <output path>" line. detail is the
+// number of texels per shading sample of shading=auto, see GL::glShadingRate(). supersample=N renders N times
+// larger (16 at most) and box filters the frame down. depth is the zbuffer format, see DepthBuffer. With stream=1
+// the meshes are read a chunk at a time from <obj>.chunks (built on first use) and never held whole, see
+// MeshStream.
+// region renders only those pixels of the width x height frame, exactly as in the whole frame, see
+// RenderJob::frame_x. With out=- nothing is written, the answer is a "pixels <width> <height> <bytes per pixel>"
+// line followed by the pixels of the frame (or region), row by row from the bottom, and progressive is ignored.
+// A "shutdown" line stops the server, "trace <file.json>" writes the spans recorded so far when tracing is
+// compiled in, see trace.h. Over TCP nothing is written on the server: a job needs out=- and no stream (it
+// writes the .chunks files next to the objs), and shutdown and trace are refused, the server is stopped with a
+// signal.
+// Models and textures stay loaded between jobs. The connections are read by one thread, their jobs go to a pool
+// of worker threads, one job of a connection at a time: an idle client holds no thread. A frame of more than
+// 8192 x 8192 pixels, supersampling included, is refused.
+int serve(const char *address, int workers, Model::TextureStorage storage = Model::RAW_TEXTURES);
+
+// a socket connected to the server at address, -1 with the reason on std::cerr on failure
+int connect_to(const std::string &address);
+
+// the render line of a job, the obj paths are the server's. The instances of a job have no line.
+std::string format_job(const RenderJob &job);
@@ -55,8 +55,7 @@ struct Shader0 : public IShader {
 
 class GouraudShader : public IShader {
 private:
-    Vec3f varying_intensity;        // write by vertex shader, read by fragment shader
-    mat<2, 3, float> varying_uv;    // write by vertex shader, read by fragment shader
+    // varyings: intensity, u, v
     Vec3f light_dir = {1, 1, 1};
     Model *model = nullptr;
     Matrix mvp;
@@ -66,6 +65,14 @@ public:
         this->mvp = mvp;
     }
 
+    Matrix get_mvp() override {
+        return mvp;
+    }
+
+    bool has_mvp() override {
+        return true;
+    }
+
     Model *get_model() override {
         return model;
     }
@@ -74,24 +81,48 @@ public:
         this->model = model;
     }
 
+    int nvaryings() override {
+        return 3;
+    }
+
+    int texcoords(Vec2f &texels) override {
+        Vec2i size = model->diffuse_size();
+        texels = Vec2f(size.x, size.y);
+        return size.x ? 1 : -1;
+    }
+
     Vec4f vertex(int iface, int nthvert) override {
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        varying_intensity[nthvert] = CLAMP(model->normal(iface, nthvert) * light_dir); // diffuse light intensity
+        Vec2f uv = model->uv(iface, nthvert);
+        varyings[nthvert][0] = CLAMP(model->normal(iface, nthvert) * light_dir); // diffuse light intensity
+        varyings[nthvert][1] = uv.x;
+        varyings[nthvert][2] = uv.y;
         Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert)); // read the vertex from obj file
         return mvp * gl_Vertex;
     }
 
-    bool fragment(Vec3f bar, TGAColor &color) override {
-        float intensity = varying_intensity * bar; //interpolate intensity for current Pixel
-        Vec2f uv = varying_uv * bar; //interpolate uv for current Pixel
-        color = model->diffuse(uv) * intensity;
+    Vec4f position(int iface, int nthvert) override {
+        return mvp * embed<4>(model->vert(iface, nthvert));
+    }
+
+    bool fragment(const float *varying, TGAColor &color) override {
+        color = model->diffuse(Vec2f(varying[1], varying[2])) * varying[0];
         return false; // do not discard pixel
     }
+
+    int fragment(const Packet &packet, TGAColor color[]) override {
+        float r[Packet::SIZE], g[Packet::SIZE], b[Packet::SIZE];
+        model->diffuse_batch(Packet::SIZE, packet.varying[1], packet.varying[2], r, g, b, packet.mask);
+        for (int i = 0; i < Packet::SIZE; i++) {
+            float intensity = CLAMP(packet.varying[0][i]);
+            color[i] = TGAColor(r[i] * intensity, g[i] * intensity, b[i] * intensity);
+        }
+        return 0;
+    }
 };
 
 class NoLightShader : public IShader {
 private:
-    mat<2, 3, float> varying_uv;
+    // varyings: u, v
     Model *model = nullptr;
     Matrix mvp;
 
@@ -100,6 +131,14 @@ public:
         this->mvp = mvp;
     }
 
+    Matrix get_mvp() override {
+        return mvp;
+    }
+
+    bool has_mvp() override {
+        return true;
+    }
+
     Model *get_model() override {
         return model;
     }
@@ -108,33 +147,68 @@ public:
         this->model = model;
     }
 
+    int nvaryings() override {
+        return 2;
+    }
+
+    int texcoords(Vec2f &texels) override {
+        Vec2i size = model->diffuse_size();
+        texels = Vec2f(size.x, size.y);
+        return size.x ? 0 : -1;
+    }
+
     Vec4f vertex(int iface, int nthvert) override {
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
+        Vec2f uv = model->uv(iface, nthvert);
+        varyings[nthvert][0] = uv.x;
+        varyings[nthvert][1] = uv.y;
         Vec4f gl_Vertex = mvp * embed<4>(model->vert(iface, nthvert));
         return gl_Vertex;
     }
 
-    bool fragment(Vec3f bar, TGAColor &color) override {
-        Vec2f uv = varying_uv * bar;
-        color = model->diffuse(uv);
+    Vec4f position(int iface, int nthvert) override {
+        return mvp * embed<4>(model->vert(iface, nthvert));
+    }
+
+    bool fragment(const float *varying, TGAColor &color) override {
+        color = model->diffuse(Vec2f(varying[0], varying[1]));
         return false;
     }
+
+    int fragment(const Packet &packet, TGAColor color[]) override {
+        float r[Packet::SIZE], g[Packet::SIZE], b[Packet::SIZE];
+        model->diffuse_batch(Packet::SIZE, packet.varying[0], packet.varying[1], r, g, b, packet.mask);
+        for (int i = 0; i < Packet::SIZE; i++) color[i] = TGAColor(r[i], g[i], b[i]);
+        return 0;
+    }
 };
 
 struct BumpShader : public IShader {
+    // varyings: u, v, normal x, y, z. The triangle uvs and positions are kept for the tangent basis.
     mat<2, 3, float> varying_uv;
     mat<3, 3, float> varying_tri;
-    mat<3, 3, float> varying_nrm;
     Model *model = nullptr;
     // let's do it in World Space
     Vec3f light_dir = {1, 1, 1};
     Matrix mvp;
+    Vec3f light = {1, 1, 1}; // in world space, for instances
+    // of the current instance, kept apart so that light_dir stays as set once the instances are drawn
+    Vec3f instance_dir = {1, 1, 1}; // light in object space
+    Vec3f tint = {1, 1, 1};
+    bool instanced = false, tinted = false;
 
 public:
     void set_mvp(Matrix mvp) override {
         this->mvp = mvp;
     }
 
+    Matrix get_mvp() override {
+        return mvp;
+    }
+
+    bool has_mvp() override {
+        return true;
+    }
+
     void set_model(Model *model) override {
         this->model = model;
     }
@@ -143,18 +217,52 @@ public:
         return model;
     }
 
+    int nvaryings() override {
+        return 5;
+    }
+
+    int texcoords(Vec2f &texels) override {
+        Vec2i size = model->diffuse_size();
+        texels = Vec2f(size.x, size.y);
+        return size.x ? 0 : -1;
+    }
+
+    // the normals stay in object space, the light goes there instead: n' * l = (M^-T n) * l = n * (M^-1 l).
+    // Three parameters are an rgb tint in [0, 1].
+    void set_instance(const Matrix &transform, const float *params, int nparams) override {
+        Matrix m = transform;
+        instance_dir = proj<3>(m.invert() * embed<4>(light, 0.f)).normalize();
+        instanced = true;
+        tinted = nparams >= 3;
+        if (tinted) tint = Vec3f(params[0], params[1], params[2]);
+    }
+
+    void clear_instance() override {
+        instanced = tinted = false;
+    }
+
     Vec4f vertex(int iface, int nthvert) override {
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        varying_nrm.set_col(nthvert, model->normal(iface, nthvert));
+        Vec2f uv = model->uv(iface, nthvert);
+        Vec3f n = model->normal(iface, nthvert);
+        varying_uv.set_col(nthvert, uv);
+        varyings[nthvert][0] = uv.x;
+        varyings[nthvert][1] = uv.y;
+        varyings[nthvert][2] = n.x;
+        varyings[nthvert][3] = n.y;
+        varyings[nthvert][4] = n.z;
         Vec4f gl_Vertex = mvp * embed<4>(model->vert(iface, nthvert));
         varying_tri.set_col(nthvert, proj<3>(gl_Vertex));
         light_dir = light_dir.normalize();
         return gl_Vertex;
     }
 
+    Vec4f position(int iface, int nthvert) override {
+        return mvp * embed<4>(model->vert(iface, nthvert));
+    }
+
 #define BUMP_NORMAL 1
-    mat<3, 3, float> compute_tbn_mat(const Vec3f &bar) {
-        Vec3f vn = (varying_nrm * bar).normalize();
+    mat<3, 3, float> compute_tbn_mat(Vec3f vn) {
+        vn.normalize();
         mat<3, 3, float> TBN;
         TBN.set_col(2, vn);
 
@@ -199,11 +307,43 @@ public:
         return TBN;
     }
 
-    bool fragment(Vec3f bar, TGAColor &color) override {
-        Vec2f uv = varying_uv * bar;
-        Vec3f n = (compute_tbn_mat(bar) * model->normal(uv)).normalize();
-        color = model->diffuse(uv) * std::max(0.f, n * light_dir);
+    bool fragment(const float *varying, TGAColor &color) override {
+        Vec2f uv(varying[0], varying[1]);
+        Vec3f n = (compute_tbn_mat(Vec3f(varying[2], varying[3], varying[4])) * model->normal(uv)).normalize();
+        color = model->diffuse(uv) * std::max(0.f, n * (instanced ? instance_dir : light_dir));
+        if (tinted) color = TGAColor(color[2] * tint.x, color[1] * tint.y, color[0] * tint.z);
 
         return false;
     }
+
+#if (BUMP_NORMAL == 1)
+    // compute_tbn_mat() without the matrix inverse: the columns of the inverse of the matrix with the rows
+    // e1, e2, n are (e2 x n, n x e1, e1 x e2) / det, and only the first two are needed
+    int fragment(const Packet &packet, TGAColor color[]) override {
+        const int N = Packet::SIZE;
+        float r[N], g[N], b[N], tx[N], ty[N], tz[N];
+        model->diffuse_batch(N, packet.varying[0], packet.varying[1], r, g, b, packet.mask);
+        model->normal_batch(N, packet.varying[0], packet.varying[1], tx, ty, tz, packet.mask);
+        Vec3f e1 = varying_tri.col(1) - varying_tri.col(0), e2 = varying_tri.col(2) - varying_tri.col(0);
+        float du1 = varying_uv[0][1] - varying_uv[0][0], du2 = varying_uv[0][2] - varying_uv[0][0];
+        float dv1 = varying_uv[1][1] - varying_uv[1][0], dv2 = varying_uv[1][2] - varying_uv[1][0];
+        const Vec3f l = instanced ? instance_dir : light_dir;
+        for (int i = 0; i < N; i++) {
+            if (!(packet.mask >> i & 1)) continue;
+            Vec3f vn = Vec3f(packet.varying[2][i], packet.varying[3][i], packet.varying[4][i]).normalize();
+            Vec3f c0 = cross(e2, vn), c1 = cross(vn, e1);
+            float det = e1 * c0;
+            Vec3f t = ((c0 * du1 + c1 * du2) / det).normalize();
+            Vec3f bt = ((c0 * dv1 + c1 * dv2) / det).normalize();
+            Vec3f n = (t * tx[i] + bt * ty[i] + vn * tz[i]).normalize();
+            float intensity = std::min(1.f, std::max(0.f, n * l)); // also zero for NaNs off the triangle
+            if (tinted) {
+                color[i] = TGAColor(r[i] * intensity * tint.x, g[i] * intensity * tint.y, b[i] * intensity * tint.z);
+            } else {
+                color[i] = TGAColor(r[i] * intensity, g[i] * intensity, b[i] * intensity);
+            }
+        }
+        return 0;
+    }
+#endif
 };
\ No newline at end of file
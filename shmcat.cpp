@@ -0,0 +1,41 @@
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include "framesink.h"
+
+// The consumer side of a shared memory frame ring (tinyrenderer --sink=shm:<name>): writes every frame raw to
+// stdout, rows top down, until the producer is done, e.g.
+//   tinyrenderer-shmcat /frames | ffmpeg -f rawvideo -pix_fmt bgr24 -s 800x800 -i - out.mp4
+// Waits up to timeout seconds for the ring to be created.
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <name> [timeout=10]" << std::endl;
+        return 1;
+    }
+    FrameRing ring;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(argc > 2 ? std::atoi(argv[2]) : 10);
+    while (!ring.open(argv[1])) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            std::cerr << "no frame ring " << argv[1] << std::endl;
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::cerr << "frames of " << ring.width() << "x" << ring.height() << ", " << ring.bytespp() << " bytes per pixel"
+              << std::endl;
+    std::vector<iovec> rows;
+    int frames = 0;
+    while (const unsigned char *pixels = ring.next()) {
+        bool ok = write_rows_top_down(STDOUT_FILENO, pixels, ring.width(), ring.height(), ring.bytespp(), rows);
+        ring.release();
+        if (!ok) {
+            std::cerr << "can't write frame " << frames << std::endl;
+            return 1;
+        }
+        frames++;
+    }
+    std::cerr << frames << " frames" << std::endl;
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include <queue>
+#include <algorithm>
+#include "simplify.h"
+
+namespace {
+    // symmetric 4x4 error quadric, upper triangle only
+    struct Quadric {
+        double q[10];
+
+        Quadric() {
+            for (double &x : q) x = 0;
+        }
+
+        Quadric(double a, double b, double c, double d, double weight) {
+            q[0] = a * a, q[1] = a * b, q[2] = a * c, q[3] = a * d;
+            q[4] = b * b, q[5] = b * c, q[6] = b * d;
+            q[7] = c * c, q[8] = c * d;
+            q[9] = d * d;
+            for (double &x : q) x *= weight;
+        }
+
+        Quadric &operator+=(const Quadric &o) {
+            for (int i = 0; i < 10; i++) q[i] += o.q[i];
+            return *this;
+        }
+
+        double error(const Vec3f &p) const {
+            double x = p.x, y = p.y, z = p.z;
+            return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+                   + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+                   + q[7] * z * z + 2 * q[8] * z
+                   + q[9];
+        }
+    };
+
+    struct Collapse {
+        double cost;
+        int from, to;
+        int stamp_from, stamp_to;
+
+        bool operator<(const Collapse &o) const {
+            return cost > o.cost; // std::priority_queue is a max-heap
+        }
+    };
+
+    Vec3f face_normal(const Vec3f &a, const Vec3f &b, const Vec3f &c) {
+        return cross(b - a, c - a);
+    }
+}
+
+std::vector<Vec3i> simplify(const std::vector<Vec3f> &verts, const std::vector<Vec3i> &corners, size_t target_faces) {
+    const int nverts = (int) verts.size();
+    const int nfaces = (int) corners.size() / 3;
+    std::vector<Vec3i> tri(corners);
+    std::vector<char> alive(nfaces, 1);
+    std::vector<char> locked(nverts, 0);
+    std::vector<char> removed(nverts, 0);
+    std::vector<int> stamp(nverts, 0);
+    std::vector<Vec2i> attr(nverts, Vec2i(-1, -1)); // the uv/normal pair of every seam-free vertex
+    std::vector<std::vector<int> > vfaces(nverts);
+    std::vector<Quadric> quadrics(nverts);
+
+    std::vector<long long> edges;
+    for (int f = 0; f < nfaces; f++) {
+        Vec3f n = face_normal(verts[tri[3 * f][0]], verts[tri[3 * f + 1][0]], verts[tri[3 * f + 2][0]]);
+        float area = n.norm();
+        if (area > 0) n = n / area;
+        Quadric plane(n.x, n.y, n.z, -(n * verts[tri[3 * f][0]]), area);
+        for (int j = 0; j < 3; j++) {
+            const Vec3i &c = tri[3 * f + j];
+            vfaces[c[0]].push_back(f);
+            quadrics[c[0]] += plane;
+            if (attr[c[0]].x < 0 && attr[c[0]].y < 0) attr[c[0]] = Vec2i(c[1], c[2]);
+            else if (attr[c[0]].x != c[1] || attr[c[0]].y != c[2]) locked[c[0]] = 1;
+            int a = c[0], b = tri[3 * f + (j + 1) % 3][0];
+            edges.push_back((long long) std::min(a, b) << 32 | std::max(a, b));
+        }
+    }
+
+    // boundary and non-manifold edges are kept as they are
+    std::sort(edges.begin(), edges.end());
+    for (size_t i = 0, j; i < edges.size(); i = j) {
+        for (j = i; j < edges.size() && edges[j] == edges[i]; j++);
+        if (j - i != 2) {
+            locked[edges[i] >> 32] = 1;
+            locked[edges[i] & 0xffffffff] = 1;
+        }
+    }
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    std::priority_queue<Collapse> heap;
+    auto push = [&](int from, int to) {
+        if (locked[from] || locked[to]) return;
+        Quadric q = quadrics[from];
+        q += quadrics[to];
+        heap.push({q.error(verts[to]), from, to, stamp[from], stamp[to]});
+    };
+    for (long long e : edges) {
+        push((int) (e >> 32), (int) (e & 0xffffffff));
+        push((int) (e & 0xffffffff), (int) (e >> 32));
+    }
+
+    auto neighbours = [&](int v, std::vector<int> &out) {
+        out.clear();
+        for (int f : vfaces[v]) {
+            if (!alive[f]) continue;
+            for (int j = 0; j < 3; j++) {
+                if (tri[3 * f + j][0] != v) out.push_back(tri[3 * f + j][0]);
+            }
+        }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+    };
+
+    auto contains = [&](int f, int v) {
+        return tri[3 * f][0] == v || tri[3 * f + 1][0] == v || tri[3 * f + 2][0] == v;
+    };
+
+    size_t faces_left = (size_t) nfaces;
+    std::vector<int> na, nb, common;
+    while (faces_left > target_faces && !heap.empty()) {
+        Collapse c = heap.top();
+        heap.pop();
+        int a = c.from, b = c.to;
+        if (removed[a] || removed[b] || stamp[a] != c.stamp_from || stamp[b] != c.stamp_to) continue;
+
+        // link condition: a and b may only share the neighbours opposite to their common faces
+        neighbours(a, na);
+        neighbours(b, nb);
+        common.clear();
+        std::set_intersection(na.begin(), na.end(), nb.begin(), nb.end(), std::back_inserter(common));
+        int shared = 0;
+        for (int f : vfaces[a]) shared += alive[f] && contains(f, b);
+        if ((int) common.size() != shared) continue;
+
+        // moving a onto b must not fold any of the remaining faces over
+        bool flips = false;
+        for (int f : vfaces[a]) {
+            if (!alive[f] || contains(f, b)) continue;
+            Vec3f p[3];
+            for (int j = 0; j < 3; j++) p[j] = verts[tri[3 * f + j][0]];
+            Vec3f before = face_normal(p[0], p[1], p[2]);
+            for (int j = 0; j < 3; j++) if (tri[3 * f + j][0] == a) p[j] = verts[b];
+            Vec3f after = face_normal(p[0], p[1], p[2]);
+            float la = after.norm(), lb = before.norm();
+            if (la <= 1e-12f || before * after < .2f * la * lb) {
+                flips = true;
+                break;
+            }
+        }
+        if (flips) continue;
+
+        for (int f : vfaces[a]) {
+            if (!alive[f]) continue;
+            if (contains(f, b)) {
+                alive[f] = 0;
+                faces_left--;
+                continue;
+            }
+            for (int j = 0; j < 3; j++) {
+                if (tri[3 * f + j][0] == a) tri[3 * f + j] = Vec3i(b, attr[b].x, attr[b].y);
+            }
+            vfaces[b].push_back(f);
+        }
+        vfaces[a].clear();
+        removed[a] = 1;
+        quadrics[b] += quadrics[a];
+        stamp[a]++;
+        stamp[b]++;
+
+        std::vector<int> &fb = vfaces[b];
+        fb.erase(std::remove_if(fb.begin(), fb.end(), [&](int f) { return !alive[f]; }), fb.end());
+        neighbours(b, nb);
+        for (int n : nb) {
+            push(n, b);
+            push(b, n);
+        }
+    }
+
+    std::vector<Vec3i> result;
+    result.reserve(faces_left * 3);
+    for (int f = 0; f < nfaces; f++) {
+        if (!alive[f]) continue;
+        for (int j = 0; j < 3; j++) result.push_back(tri[3 * f + j]);
+    }
+    return result;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+
+// Quadric error metric mesh simplification (Garland & Heckbert), half-edge collapses only.
+// corners is a flat triangle list of vertex/uv/normal triplets, as stored by Model.
+// Vertices referenced with more than one uv or normal (texture seams) and boundary vertices are never
+// moved, so the surviving corners keep valid attributes and seams stay where they are.
+// Returns the simplified triangle list, with at most target_faces triangles when that is reachable.
+std::vector<Vec3i> simplify(const std::vector<Vec3f> &verts, const std::vector<Vec3i> &corners, size_t target_faces);
@@ -0,0 +1,113 @@
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "texture.h"
+
+// Compares block compressed textures with the raw ones: memory, error and random access sampling throughput.
+// Normal maps (a "_nm" in the file name) are encoded as BC5, everything else as BC1.
+// The raw texture sampled 8 texels at a time with get8().
+// Then the paged texture: time to open (the tiles file is built on the first run), resident memory after the
+// sampling and whether it samples exactly like the raw one.
+namespace {
+    volatile float sink; // what the timed loops sampled, so that they are not optimized away
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " texture.tga..." << std::endl;
+        return 1;
+    }
+    const int samples = 4000000;
+    for (int m = 1; m < argc; m++) {
+        Texture::Format format = std::string(argv[m]).find("_nm") != std::string::npos ? Texture::BC5 : Texture::BC1;
+        Texture raw, packed;
+        if (!raw.read_tga_file(argv[m], Texture::RAW) || !packed.read_tga_file(argv[m], format)) continue;
+        int w = raw.get_width(), h = raw.get_height();
+
+        double err = 0;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                TGAColor a = raw.get(x, y), b = packed.get(x, y);
+                for (int i = 0; i < 3; i++) err += (a[i] - b[i]) * (a[i] - b[i]);
+            }
+        }
+        double psnr = 10 * std::log10(255. * 255. / (err / (3. * w * h) + 1e-12));
+
+        double mtexels[2];
+        Texture *textures[2] = {&raw, &packed};
+        for (int k = 0; k < 2; k++) {
+            std::mt19937 rng(1);
+            std::uniform_real_distribution<float> uv(0.f, 1.f);
+            unsigned int sum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < samples; i++) {
+                TGAColor c = textures[k]->get(int(uv(rng) * w), int(uv(rng) * h));
+                sum += c[0] + c[1] + c[2];
+            }
+            double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            sink = sum;
+            mtexels[k] = samples / s / 1e6;
+        }
+
+        std::cout << argv[m] << " " << w << "x" << h << " " << (format == Texture::BC1 ? "BC1" : "BC5")
+                  << ": " << raw.memory() / 1024 << " KiB -> " << packed.memory() / 1024 << " KiB ("
+                  << double(raw.memory()) / packed.memory() << "x), PSNR " << psnr << " dB, sampling "
+                  << mtexels[0] << " -> " << mtexels[1] << " Mtexel/s" << std::endl;
+
+        std::vector<int> xs(samples), ys(samples);
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> uv(0.f, 1.f);
+        for (int i = 0; i < samples; i++) xs[i] = int(uv(rng) * w), ys[i] = int(uv(rng) * h);
+        double scalar_s, batch_s;
+        float sum = 0;
+        int mismatches = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < samples; i++) {
+            TGAColor c = raw.get(xs[i], ys[i]);
+            sum += c[0] + c[1] + c[2];
+        }
+        scalar_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < samples; i += 8) {
+            float r[8], g[8], b[8];
+            raw.get8(&xs[i], &ys[i], r, g, b);
+            for (int j = 0; j < 8; j++) sum -= r[j] + g[j] + b[j];
+        }
+        batch_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (int i = 0; i < samples; i += 8) {
+            float r[8], g[8], b[8];
+            raw.get8(&xs[i], &ys[i], r, g, b);
+            for (int j = 0; j < 8; j++) {
+                TGAColor c = raw.get(xs[i + j], ys[i + j]);
+                mismatches += r[j] != c[2] || g[j] != c[1] || b[j] != c[0];
+            }
+        }
+        sink = sum;
+        std::cout << "  raw get8: " << samples / scalar_s / 1e6 << " -> " << samples / batch_s / 1e6
+                  << " Mtexel/s, " << mismatches << " mismatches" << std::endl;
+
+        Texture::set_paging(4 << 20, false);
+        Texture fresh, paged;
+        start = std::chrono::steady_clock::now();
+        fresh.read_tga_file(argv[m], Texture::RAW);
+        double raw_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+        if (!paged.read_tga_file(argv[m], Texture::PAGED)) continue;
+        double paged_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        mismatches = 0;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < samples; i++) {
+            int x = int(uv(rng) * w), y = int(uv(rng) * h);
+            TGAColor a = raw.get(x, y), b = paged.get(x, y);
+            mismatches += a[0] != b[0] || a[1] != b[1] || a[2] != b[2];
+        }
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "  paged: open " << raw_ms << " -> " << paged_ms << " ms, resident " << paged.memory() / 1024
+                  << " KiB, " << samples / s / 1e6 << " Mtexel/s with raw compare, " << mismatches << " mismatches"
+                  << std::endl;
+    }
+    return 0;
+}
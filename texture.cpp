@@ -0,0 +1,625 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include <sys/stat.h>
+#include <unistd.h>
+#include "texture.h"
+#include "trace.h"
+
+namespace {
+    const int BLOCK = 4;
+
+    unsigned short pack565(const float c[3]) {
+        int r = std::min(31, std::max(0, int(c[0] * 31.f / 255.f + .5f)));
+        int g = std::min(63, std::max(0, int(c[1] * 63.f / 255.f + .5f)));
+        int b = std::min(31, std::max(0, int(c[2] * 31.f / 255.f + .5f)));
+        return static_cast<unsigned short>(r << 11 | g << 5 | b);
+    }
+
+    void unpack565(unsigned short v, int c[3]) {
+        int r = v >> 11 & 31, g = v >> 5 & 63, b = v & 31;
+        c[0] = r << 3 | r >> 2;
+        c[1] = g << 2 | g >> 4;
+        c[2] = b << 3 | b >> 2;
+    }
+
+    // the 4 color palette of a BC1 block (the 3 color + transparent mode is never written)
+    void bc1_palette(const unsigned char *block, int palette[4][3]) {
+        unpack565(static_cast<unsigned short>(block[0] | block[1] << 8), palette[0]);
+        unpack565(static_cast<unsigned short>(block[2] | block[3] << 8), palette[1]);
+        for (int i = 0; i < 3; i++) {
+            palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+            palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+        }
+    }
+
+    // rgb texels, endpoints are the extremes along the principal axis of the block colors
+    void encode_bc1(const unsigned char texels[16][3], unsigned char *block) {
+        float mean[3] = {0, 0, 0};
+        for (int t = 0; t < 16; t++) for (int i = 0; i < 3; i++) mean[i] += texels[t][i] / 16.f;
+        float cov[3][3] = {};
+        for (int t = 0; t < 16; t++) {
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) cov[i][j] += (texels[t][i] - mean[i]) * (texels[t][j] - mean[j]);
+            }
+        }
+        float axis[3] = {1, 1, 1};
+        for (int iter = 0; iter < 8; iter++) {
+            float next[3], len = 0;
+            for (int i = 0; i < 3; i++) {
+                next[i] = cov[i][0] * axis[0] + cov[i][1] * axis[1] + cov[i][2] * axis[2];
+                len = std::max(len, std::abs(next[i]));
+            }
+            if (len == 0) break;
+            for (int i = 0; i < 3; i++) axis[i] = next[i] / len;
+        }
+        int lo = 0, hi = 0;
+        float dmin = 1e30f, dmax = -1e30f;
+        for (int t = 0; t < 16; t++) {
+            float d = 0;
+            for (int i = 0; i < 3; i++) d += (texels[t][i] - mean[i]) * axis[i];
+            if (d < dmin) dmin = d, lo = t;
+            if (d > dmax) dmax = d, hi = t;
+        }
+        float c0[3], c1[3];
+        for (int i = 0; i < 3; i++) c0[i] = texels[hi][i], c1[i] = texels[lo][i];
+        unsigned short e0 = pack565(c0), e1 = pack565(c1);
+        if (e0 < e1) std::swap(e0, e1);
+        block[0] = static_cast<unsigned char>(e0 & 255);
+        block[1] = static_cast<unsigned char>(e0 >> 8);
+        block[2] = static_cast<unsigned char>(e1 & 255);
+        block[3] = static_cast<unsigned char>(e1 >> 8);
+        unsigned int indices = 0;
+        if (e0 != e1) {
+            int palette[4][3];
+            bc1_palette(block, palette);
+            for (int t = 0; t < 16; t++) {
+                int best = 0, best_d = 1 << 30;
+                for (int p = 0; p < 4; p++) {
+                    int d = 0;
+                    for (int i = 0; i < 3; i++) d += (texels[t][i] - palette[p][i]) * (texels[t][i] - palette[p][i]);
+                    if (d < best_d) best_d = d, best = p;
+                }
+                indices |= static_cast<unsigned int>(best) << (2 * t);
+            }
+        }
+        for (int i = 0; i < 4; i++) block[4 + i] = static_cast<unsigned char>(indices >> (8 * i));
+    }
+
+    int bc4_value(int e0, int e1, int index) {
+        if (index < 2) return index ? e1 : e0;
+        return ((8 - index) * e0 + (index - 1) * e1) / 7;
+    }
+
+    void encode_bc4(const unsigned char texels[16], unsigned char *block) {
+        int e0 = *std::max_element(texels, texels + 16), e1 = *std::min_element(texels, texels + 16);
+        block[0] = static_cast<unsigned char>(e0);
+        block[1] = static_cast<unsigned char>(e1);
+        unsigned long long indices = 0;
+        if (e0 != e1) {
+            for (int t = 0; t < 16; t++) {
+                int best = 0, best_d = 256;
+                for (int p = 0; p < 8; p++) {
+                    int d = std::abs(texels[t] - bc4_value(e0, e1, p));
+                    if (d < best_d) best_d = d, best = p;
+                }
+                indices |= static_cast<unsigned long long>(best) << (3 * t);
+            }
+        }
+        for (int i = 0; i < 6; i++) block[2 + i] = static_cast<unsigned char>(indices >> (8 * i));
+    }
+
+    int decode_bc4(const unsigned char *block, int t) {
+        unsigned long long indices = 0;
+        for (int i = 0; i < 6; i++) indices |= static_cast<unsigned long long>(block[2 + i]) << (8 * i);
+        return bc4_value(block[0], block[1], static_cast<int>(indices >> (3 * t) & 7));
+    }
+
+    int block_bytes(Texture::Format format) {
+        return format == Texture::BC1 ? 8 : 16;
+    }
+
+    const int TILE = 64;
+    const int COARSE = 128;
+    const char TILES_MAGIC[8] = {'T', 'R', 'T', 'I', 'L', 'E', 'S', '1'};
+
+    size_t paging_budget = 64 << 20;
+    bool paging_async = false;
+    std::string tile_cache; // the directory of the tiles files, empty for next to the images
+
+    // <file>.tiles, or in the cache directory the file name and a hash of its path, the same name can come from
+    // several directories
+    std::string tiles_path(const char *filename) {
+        if (tile_cache.empty()) return std::string(filename) + ".tiles";
+        std::string name = filename, base = name.substr(name.rfind('/') + 1);
+        char hash[17];
+        snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(std::hash<std::string>()(name)));
+        return tile_cache + "/" + base + "." + hash + ".tiles";
+    }
+
+    // the tiles in row major order follow the header, then the coarse mip
+    struct TilesHeader {
+        char magic[8];
+        int width;
+        int height;
+        int bytespp;
+        int tile;
+        int coarse_scale; // the coarse mip is a box filter of coarse_scale x coarse_scale texels
+        int coarse_width;
+        int coarse_height;
+        int pad;
+        long long source_size;
+        long long source_mtime;
+    };
+
+    // reads a TGA file one row at a time in file order, so a texture larger than memory can be tiled
+    class TGARowReader {
+    public:
+        int width = 0;
+        int height = 0;
+        int bytespp = 0;
+        bool top_down = false;
+
+        bool open(const char *filename) {
+            in.open(filename, std::ios::binary);
+            TGA_Header header;
+            in.read((char *) &header, sizeof(header));
+            if (!in.good()) return false;
+            width = header.width;
+            height = header.height;
+            bytespp = header.bitsperpixel >> 3;
+            top_down = header.imagedescriptor & 0x20;
+            right_to_left = header.imagedescriptor & 0x10;
+            rle = header.datatypecode == 10 || header.datatypecode == 11;
+            bool raw = header.datatypecode == 2 || header.datatypecode == 3;
+            if (width <= 0 || height <= 0 || (bytespp != 1 && bytespp != 3 && bytespp != 4) || (!rle && !raw)) {
+                return false;
+            }
+            in.ignore((unsigned char) header.idlength);
+            return in.good();
+        }
+
+        bool read_row(unsigned char *row) {
+            if (!rle) {
+                in.read((char *) row, width * bytespp);
+            } else {
+                for (int x = 0; x < width; x++) { // a run may continue on the next row
+                    if (!run) {
+                        int chunk = in.get();
+                        run = (chunk & 127) + 1;
+                        repeat = chunk >= 128;
+                        if (repeat) in.read((char *) pixel, bytespp);
+                    }
+                    if (!repeat) in.read((char *) pixel, bytespp);
+                    memcpy(row + x * bytespp, pixel, bytespp);
+                    run--;
+                }
+            }
+            if (right_to_left) {
+                for (int x = 0; x < width / 2; x++) {
+                    std::swap_ranges(row + x * bytespp, row + (x + 1) * bytespp, row + (width - 1 - x) * bytespp);
+                }
+            }
+            return in.good();
+        }
+
+    private:
+        std::ifstream in;
+        bool right_to_left = false;
+        bool rle = false;
+        int run = 0;
+        bool repeat = false;
+        unsigned char pixel[4] = {};
+    };
+
+    // one band of tile rows in memory at a time, written in place, so the header goes last and a partial file
+    // is never mistaken for a valid one
+    bool build_tiles(const char *filename, const std::string &tiles, const struct stat &source) {
+        TRACE_SCOPE("texture tiling");
+        TGARowReader reader;
+        if (!reader.open(filename)) {
+            std::cerr << "can't read " << filename << "\n";
+            return false;
+        }
+        int w = reader.width, h = reader.height, bpp = reader.bytespp;
+        TilesHeader header = {};
+        memcpy(header.magic, TILES_MAGIC, sizeof(TILES_MAGIC));
+        header.width = w;
+        header.height = h;
+        header.bytespp = bpp;
+        header.tile = TILE;
+        header.coarse_scale = (std::max(w, h) + COARSE - 1) / COARSE;
+        header.coarse_width = (w + header.coarse_scale - 1) / header.coarse_scale;
+        header.coarse_height = (h + header.coarse_scale - 1) / header.coarse_scale;
+        header.source_size = source.st_size;
+        header.source_mtime = source.st_mtime;
+
+        std::string tmp = tiles + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        int tiles_x = (w + TILE - 1) / TILE, tiles_y = (h + TILE - 1) / TILE;
+        size_t row_bytes = static_cast<size_t>(w) * bpp, tile_bytes = static_cast<size_t>(TILE) * TILE * bpp;
+        std::vector<unsigned char> band(row_bytes * TILE), tile(tile_bytes), row(row_bytes);
+        std::vector<unsigned int> coarse(static_cast<size_t>(header.coarse_width) * header.coarse_height * bpp, 0);
+        bool ok = true;
+        int filled = 0;
+        for (int r = 0; r < h && ok; r++) {
+            int y = reader.top_down ? h - 1 - r : r; // the row order Texture::read_tga_file ends up with
+            ok = reader.read_row(&band[(y % TILE) * row_bytes]);
+            const unsigned char *texels = &band[(y % TILE) * row_bytes];
+            unsigned int *sums = &coarse[static_cast<size_t>(y / header.coarse_scale) * header.coarse_width * bpp];
+            for (int x = 0; x < w; x++) {
+                for (int i = 0; i < bpp; i++) sums[x / header.coarse_scale * bpp + i] += texels[x * bpp + i];
+            }
+            int ty = y / TILE;
+            if (++filled < std::min(TILE, h - ty * TILE)) continue;
+            filled = 0;
+            for (int tx = 0; tx < tiles_x && ok; tx++) {
+                std::fill(tile.begin(), tile.end(), 0);
+                int tw = std::min(TILE, w - tx * TILE);
+                for (int j = 0; j < std::min(TILE, h - ty * TILE); j++) {
+                    memcpy(&tile[j * TILE * bpp], &band[j * row_bytes + tx * TILE * bpp], tw * bpp);
+                }
+                off_t offset = sizeof(header) + (static_cast<off_t>(ty) * tiles_x + tx) * tile_bytes;
+                ok = pwrite(fd, tile.data(), tile_bytes, offset) == (ssize_t) tile_bytes;
+            }
+        }
+        std::vector<unsigned char> mip(coarse.size());
+        for (int cy = 0; cy < header.coarse_height; cy++) {
+            for (int cx = 0; cx < header.coarse_width; cx++) {
+                unsigned int n = std::min(header.coarse_scale, w - cx * header.coarse_scale) *
+                                 std::min(header.coarse_scale, h - cy * header.coarse_scale);
+                for (int i = 0; i < bpp; i++) {
+                    size_t k = (static_cast<size_t>(cy) * header.coarse_width + cx) * bpp + i;
+                    mip[k] = static_cast<unsigned char>((coarse[k] + n / 2) / n);
+                }
+            }
+        }
+        off_t end = sizeof(header) + static_cast<off_t>(tiles_x) * tiles_y * tile_bytes;
+        ok = ok && pwrite(fd, mip.data(), mip.size(), end) == (ssize_t) mip.size();
+        ok = ok && pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header);
+        ok = close(fd) == 0 && ok;
+        ok = ok && rename(tmp.c_str(), tiles.c_str()) == 0;
+        if (!ok) unlink(tmp.c_str());
+        return ok;
+    }
+}
+
+// resident tiles live in slots, a tile not used since the clock hand last passed it is evicted first
+struct Texture::Pager {
+    int fd = -1;
+    int bytespp = 0;
+    int tiles_x = 0;
+    size_t tile_bytes = 0;
+    int coarse_scale = 1;
+    int coarse_width = 0;
+    std::vector<unsigned char> coarse;
+
+    std::mutex mutex;
+    size_t max_slots = 1;
+    std::vector<int> slot_of;          // per tile, -1 when not resident
+    std::vector<int> tile_of;          // per slot
+    std::vector<char> referenced;      // per slot
+    std::vector<unsigned char> slots;
+    size_t hand = 0;
+
+    bool async = false;
+    std::vector<char> requested;       // per tile, queued or resident
+    std::deque<int> queue;
+    std::condition_variable wake;
+    std::thread loader;
+    bool stopping = false;
+
+    ~Pager() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (loader.joinable()) loader.join();
+        if (fd >= 0) close(fd);
+    }
+
+    bool open(const std::string &tiles, const struct stat &source) {
+        fd = ::open(tiles.c_str(), O_RDONLY);
+        TilesHeader header;
+        if (fd < 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) return false;
+        if (memcmp(header.magic, TILES_MAGIC, sizeof(TILES_MAGIC)) || header.tile != TILE ||
+            header.source_size != source.st_size || header.source_mtime != source.st_mtime) {
+            return false;
+        }
+        bytespp = header.bytespp;
+        tiles_x = (header.width + TILE - 1) / TILE;
+        int tiles_y = (header.height + TILE - 1) / TILE;
+        tile_bytes = static_cast<size_t>(TILE) * TILE * bytespp;
+        coarse_scale = header.coarse_scale;
+        coarse_width = header.coarse_width;
+        coarse.resize(static_cast<size_t>(header.coarse_width) * header.coarse_height * bytespp);
+        off_t offset = sizeof(header) + static_cast<off_t>(tiles_x) * tiles_y * tile_bytes;
+        if (pread(fd, coarse.data(), coarse.size(), offset) != (ssize_t) coarse.size()) return false;
+        slot_of.assign(static_cast<size_t>(tiles_x) * tiles_y, -1);
+        requested.assign(slot_of.size(), 0);
+        max_slots = std::max<size_t>(1, std::min(slot_of.size(), paging_budget / tile_bytes));
+        async = paging_async;
+        return true;
+    }
+
+    void read(int tile, unsigned char *dst) {
+        TRACE_SCOPE("texture page in");
+        off_t offset = sizeof(TilesHeader) + static_cast<off_t>(tile) * tile_bytes;
+        if (pread(fd, dst, tile_bytes, offset) != (ssize_t) tile_bytes) memset(dst, 0, tile_bytes);
+    }
+
+    // with the lock held
+    int install(int tile) {
+        int slot;
+        if (tile_of.size() < max_slots) {
+            slot = (int) tile_of.size();
+            tile_of.push_back(tile);
+            referenced.push_back(0);
+            slots.resize(slots.size() + tile_bytes);
+        } else {
+            while (referenced[hand]) {
+                referenced[hand] = 0;
+                hand = (hand + 1) % tile_of.size();
+            }
+            slot = (int) hand;
+            hand = (hand + 1) % tile_of.size();
+            slot_of[tile_of[slot]] = -1;
+            requested[tile_of[slot]] = 0;
+            tile_of[slot] = tile;
+        }
+        slot_of[tile] = slot;
+        requested[tile] = 1;
+        return slot;
+    }
+
+    void load_requested() {
+        std::vector<unsigned char> buffer(tile_bytes);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) return;
+            int tile = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            read(tile, buffer.data());
+            lock.lock();
+            int slot = install(tile);
+            memcpy(&slots[slot * tile_bytes], buffer.data(), tile_bytes);
+        }
+    }
+
+    TGAColor get(int x, int y) {
+        int tile = (y / TILE) * tiles_x + x / TILE;
+        std::unique_lock<std::mutex> lock(mutex);
+        int slot = slot_of[tile];
+        if (slot < 0 && async) {
+            if (!requested[tile]) {
+                requested[tile] = 1;
+                queue.push_back(tile);
+                if (!loader.joinable()) loader = std::thread(&Pager::load_requested, this);
+                wake.notify_one();
+            }
+            size_t texel = (static_cast<size_t>(y / coarse_scale) * coarse_width + x / coarse_scale) * bytespp;
+            return {&coarse[texel], static_cast<unsigned char>(bytespp)};
+        }
+        if (slot < 0) { // read without the lock, the other threads go on sampling the resident tiles meanwhile
+            thread_local std::vector<unsigned char> buffer;
+            buffer.resize(tile_bytes);
+            lock.unlock();
+            read(tile, buffer.data());
+            lock.lock();
+            slot = slot_of[tile]; // another thread may have read it meanwhile
+            if (slot < 0) {
+                slot = install(tile);
+                memcpy(&slots[slot * tile_bytes], buffer.data(), tile_bytes);
+            }
+        }
+        referenced[slot] = 1;
+        size_t texel = slot * tile_bytes + ((y % TILE) * TILE + x % TILE) * bytespp;
+        return {&slots[texel], static_cast<unsigned char>(bytespp)};
+    }
+};
+
+Texture::Texture() : format(RAW), width(0), height(0), blocks_per_row(0), image(), blocks(), pager() {}
+
+Texture::~Texture() {}
+
+void Texture::set_paging(size_t resident_bytes, bool async) {
+    paging_budget = resident_bytes;
+    paging_async = async;
+}
+
+void Texture::set_tile_cache(const std::string &dir) {
+    tile_cache = dir;
+    while (tile_cache.size() > 1 && tile_cache.back() == '/') tile_cache.pop_back();
+}
+
+bool Texture::read_tga_file(const char *filename, Format fmt) {
+    TRACE_SCOPE("texture load");
+    format = RAW;
+    blocks.clear();
+    pager.reset();
+    if (fmt == PAGED && read_tiles(filename)) return true;
+    bool ok = image.read_tga_file(filename);
+    image.flip_vertically();
+    width = image.get_width();
+    height = image.get_height();
+    // block formats need color, single channel maps stay raw
+    if (ok && (fmt == BC1 || fmt == BC5) && image.get_bytespp() >= TGAImage::RGB) {
+        format = fmt;
+        encode(image);
+        image = TGAImage();
+    }
+    return ok;
+}
+
+void Texture::encode(TGAImage &img) {
+    TRACE_SCOPE("texture encode");
+    blocks_per_row = (width + BLOCK - 1) / BLOCK;
+    int rows = (height + BLOCK - 1) / BLOCK;
+    blocks.assign(static_cast<size_t>(blocks_per_row) * rows * block_bytes(format), 0);
+    unsigned char rgb[16][3], red[16], green[16];
+    for (int by = 0; by < rows; by++) {
+        for (int bx = 0; bx < blocks_per_row; bx++) {
+            for (int t = 0; t < 16; t++) { // edge blocks repeat the last row and column
+                TGAColor c = img.get(std::min(bx * BLOCK + t % BLOCK, width - 1), std::min(by * BLOCK + t / BLOCK, height - 1));
+                rgb[t][0] = c[2];
+                rgb[t][1] = c[1];
+                rgb[t][2] = c[0];
+                red[t] = c[2];
+                green[t] = c[1];
+            }
+            unsigned char *block = &blocks[(static_cast<size_t>(by) * blocks_per_row + bx) * block_bytes(format)];
+            if (format == BC1) {
+                encode_bc1(rgb, block);
+            } else {
+                encode_bc4(red, block);
+                encode_bc4(green, block + 8);
+            }
+        }
+    }
+}
+
+// the tiles are built on the first use of a texture, the textures that can't be tiled are loaded as RAW
+bool Texture::read_tiles(const char *filename) {
+    struct stat source;
+    if (stat(filename, &source)) return false;
+    std::string tiles = tiles_path(filename);
+    std::unique_ptr<Pager> p(new Pager());
+    if (!p->open(tiles, source)) {
+        p.reset(new Pager());
+        if (!tile_cache.empty()) mkdir(tile_cache.c_str(), 0755); // or it is already there
+        if (!build_tiles(filename, tiles, source) || !p->open(tiles, source)) {
+            std::cerr << "can't tile " << filename << ", loading it whole" << std::endl;
+            return false;
+        }
+    }
+    TilesHeader header;
+    if (pread(p->fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) return false;
+    format = PAGED;
+    width = header.width;
+    height = header.height;
+    image = TGAImage();
+    pager = std::move(p);
+    std::cerr << width << "x" << height << "/" << pager->bytespp * 8 << " paged" << std::endl;
+    return true;
+}
+
+TGAColor Texture::get(int x, int y) {
+    if (format == RAW) return image.get(x, y);
+    if (x < 0 || y < 0 || x >= width || y >= height) return {};
+    if (format == PAGED) return pager->get(x, y);
+    const unsigned char *block = &blocks[(static_cast<size_t>(y / BLOCK) * blocks_per_row + x / BLOCK) * block_bytes(format)];
+    int t = (y % BLOCK) * BLOCK + x % BLOCK;
+    unsigned char bgr[3];
+    if (format == BC1) {
+        int palette[4][3];
+        bc1_palette(block, palette);
+        unsigned int indices = block[4] | block[5] << 8 | block[6] << 16 | static_cast<unsigned int>(block[7]) << 24;
+        const int *c = palette[indices >> (2 * t) & 3];
+        bgr[0] = static_cast<unsigned char>(c[2]);
+        bgr[1] = static_cast<unsigned char>(c[1]);
+        bgr[2] = static_cast<unsigned char>(c[0]);
+    } else {
+        int r = decode_bc4(block, t), g = decode_bc4(block + 8, t);
+        float nx = r / 255.f * 2.f - 1.f, ny = g / 255.f * 2.f - 1.f;
+        float nz = std::sqrt(std::max(0.f, 1.f - nx * nx - ny * ny));
+        bgr[0] = static_cast<unsigned char>((nz + 1.f) * .5f * 255.f + .5f);
+        bgr[1] = static_cast<unsigned char>(g);
+        bgr[2] = static_cast<unsigned char>(r);
+    }
+    return {bgr, 3};
+}
+
+void Texture::get8(const int x[8], const int y[8], float r[8], float g[8], float b[8], int lanes) {
+    int bpp = image.get_bytespp();
+    if (format != RAW || bpp < TGAImage::RGB) {
+        for (int i = 0; i < 8; i++) {
+            if (!(lanes >> i & 1)) {
+                r[i] = g[i] = b[i] = 0;
+                continue;
+            }
+            TGAColor c = get(x[i], y[i]);
+            r[i] = c[2];
+            g[i] = c[1];
+            b[i] = c[0];
+        }
+        return;
+    }
+    const unsigned char *data = image.buffer();
+    int todo = lanes; // the lanes left for the scalar loop
+#ifdef __AVX2__
+    __m256i vx = _mm256_loadu_si256((const __m256i *) x), vy = _mm256_loadu_si256((const __m256i *) y);
+    __m256i minus_one = _mm256_set1_epi32(-1);
+    __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i wanted = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(lanes), bits), bits);
+    __m256i inside = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(vx, minus_one), _mm256_cmpgt_epi32(_mm256_set1_epi32(width), vx)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(vy, minus_one), _mm256_cmpgt_epi32(_mm256_set1_epi32(height), vy)));
+    inside = _mm256_and_si256(inside, wanted);
+    __m256i offset = _mm256_mullo_epi32(_mm256_add_epi32(vx, _mm256_mullo_epi32(vy, _mm256_set1_epi32(width))),
+                                        _mm256_set1_epi32(bpp));
+    // a 4 byte gather of the very last 3 byte texel would read past the image
+    __m256i safe = _mm256_cmpgt_epi32(_mm256_set1_epi32(width * height * bpp - 3), offset);
+    __m256i mask = _mm256_and_si256(inside, safe);
+    __m256i texels = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *) data, offset, mask, 1);
+    __m256i byte = _mm256_set1_epi32(0xff);
+    _mm256_storeu_ps(b, _mm256_cvtepi32_ps(_mm256_and_si256(texels, byte)));
+    _mm256_storeu_ps(g, _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texels, 8), byte)));
+    _mm256_storeu_ps(r, _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texels, 16), byte)));
+    // outside and unwanted lanes are already zero, like TGAImage::get returns
+    todo = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(safe, inside)));
+#endif
+    for (int i = 0; i < 8; i++) {
+        if (!(todo >> i & 1)) {
+#ifndef __AVX2__
+            r[i] = g[i] = b[i] = 0;
+#endif
+            continue;
+        }
+        if (x[i] < 0 || y[i] < 0 || x[i] >= width || y[i] >= height) {
+            r[i] = g[i] = b[i] = 0;
+            continue;
+        }
+        const unsigned char *p = data + (static_cast<size_t>(y[i]) * width + x[i]) * bpp;
+        r[i] = p[2];
+        g[i] = p[1];
+        b[i] = p[0];
+    }
+}
+
+int Texture::get_width() {
+    return width;
+}
+
+int Texture::get_height() {
+    return height;
+}
+
+Texture::Format Texture::get_format() {
+    return format;
+}
+
+size_t Texture::memory() {
+    if (format == RAW) return static_cast<size_t>(width) * height * image.get_bytespp();
+    if (format == PAGED) {
+        std::lock_guard<std::mutex> lock(pager->mutex);
+        return pager->slots.size() + pager->coarse.size();
+    }
+    return blocks.size();
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "tgaimage.h"
+
+// A read-only texture map. RAW keeps the TGAImage as it is, the block compressed formats encode 4x4 texels
+// at a time on load and decode the fetched texel only:
+//   BC1, 4 bits per texel: two 565 endpoints and a 2 bit index per texel, for color (diffuse) maps
+//   BC5, 8 bits per texel: red and green as two BC4 channels, for tangent space normal maps, blue is rebuilt
+//        from the unit length of the normal
+// PAGED textures are split once into 64x64 tiles in a cache file, next to the image (<file>.tiles) or in the
+// directory given to set_tile_cache(), rebuilt when older than the image, without ever holding the whole image in
+// memory. Tiles are read on first access, by the thread that samples them without holding up the others, and kept
+// in a resident set of bounded size. In asynchronous mode a missing tile is requested from a loader thread
+// and the texel is taken from a coarse mip (at most 128x128) that is always resident.
+class Texture {
+public:
+    enum Format {
+        RAW, BC1, BC5, PAGED
+    };
+
+    Texture();
+
+    ~Texture();
+
+    // resident tile memory per texture and the loading mode of the PAGED textures loaded afterwards
+    static void set_paging(size_t resident_bytes, bool async);
+
+    // the directory of the tiles files of the PAGED textures loaded afterwards, created if missing. Empty, the
+    // default, puts them next to the images, which may be read-only or shared.
+    static void set_tile_cache(const std::string &dir);
+
+    // reads the file and flips it the way Model wants its textures, then encodes it
+    bool read_tga_file(const char *filename, Format format);
+
+    // same texel addressing and out of range behavior as TGAImage::get
+    TGAColor get(int x, int y);
+
+    // 8 texels at once, the red, green and blue channels of each in [0, 255], same values as get(). Only the texels
+    // of the bits set in lanes are fetched, the others read 0.
+    // RAW color textures are fetched with AVX2 gathers when built for it, other formats one texel at a time.
+    void get8(const int x[8], const int y[8], float r[8], float g[8], float b[8], int lanes = 0xff);
+
+    int get_width();
+
+    int get_height();
+
+    Format get_format();
+
+    // bytes of texel storage, for PAGED the resident tiles and the coarse mip
+    size_t memory();
+
+private:
+    Format format;
+    int width;
+    int height;
+    int blocks_per_row;
+    TGAImage image;                    // RAW
+    std::vector<unsigned char> blocks; // BC1, BC5
+
+    struct Pager;
+    std::unique_ptr<Pager> pager;      // PAGED
+
+    void encode(TGAImage &img);
+
+    bool read_tiles(const char *filename);
+};
@@ -1,9 +1,322 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#ifdef __SSE2__
+#include <tmmintrin.h>
+#endif
 #include "tgaimage.h"
+#include "trace.h"
+
+namespace {
+    // One thread per core but one, shared by every image: the render threads of a server scaling their frames at
+    // the same time queue their bands here rather than start threads of their own. A caller of run() takes its
+    // first band and then the bands still queued, so it never waits behind a busy pool.
+    class BandPool {
+    public:
+        static BandPool &instance() {
+            static BandPool pool;
+            return pool;
+        }
+
+        int size() const {
+            return static_cast<int>(threads.size()) + 1;
+        }
+
+        // f(b) for every b in [0, bands), returns once they are all done
+        void run(int bands, const std::function<void(int)> &f) {
+            int left = bands - 1;
+            std::unique_lock<std::mutex> lock(mutex);
+            for (int b = 1; b < bands; b++) {
+                tasks.emplace_back([&, b] {
+                    f(b);
+                    std::lock_guard<std::mutex> done(mutex);
+                    if (!--left) finished.notify_all();
+                });
+            }
+            wake.notify_all();
+            lock.unlock();
+            f(0);
+            lock.lock();
+            while (left) {
+                if (tasks.empty()) {
+                    finished.wait(lock);
+                    continue;
+                }
+                std::function<void()> task = std::move(tasks.front());
+                tasks.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+
+    private:
+        BandPool() {
+            const int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+            for (int i = 1; i < cores; i++) threads.emplace_back([this] { work(); });
+        }
+
+        ~BandPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            wake.notify_all();
+            for (auto &t : threads) t.join();
+        }
+
+        void work() {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                wake.wait(lock, [this] { return stop || !tasks.empty(); });
+                if (tasks.empty()) return;
+                std::function<void()> task = std::move(tasks.front());
+                tasks.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable wake, finished;
+        std::deque<std::function<void()> > tasks;
+        std::vector<std::thread> threads;
+        bool stop = false;
+    };
+
+    // f(first, last) over bands of the rows [0, rows), one per core when there are more than bytes are worth
+    template<typename F>
+    void parallel_rows(int rows, size_t bytes, F f) {
+        const int bands = bytes < (1 << 20) ? 1 : std::min(BandPool::instance().size(), rows);
+        if (bands <= 1) {
+            f(0, rows);
+            return;
+        }
+        BandPool::instance().run(bands, [&](int b) {
+            f(rows * b / bands, rows * (b + 1) / bands);
+        });
+    }
+
+    template<int bpp>
+    void swap_pixels(unsigned char *a, unsigned char *b) {
+        unsigned char t[bpp];
+        memcpy(t, a, bpp);
+        memcpy(a, b, bpp);
+        memcpy(b, t, bpp);
+    }
+
+    // l and r are the first and last pixels of a row
+    template<int bpp>
+    void reverse_row(unsigned char *l, unsigned char *r) {
+        for (; l < r; l += bpp, r -= bpp) swap_pixels<bpp>(l, r);
+    }
+
+#ifdef __SSE2__
+    // 4 pixels from each end at a time, while the two blocks don't overlap
+    template<>
+    void reverse_row<4>(unsigned char *l, unsigned char *r) {
+        for (; r - l >= 28; l += 16, r -= 16) {
+            __m128i a = _mm_loadu_si128((__m128i *) l), b = _mm_loadu_si128((__m128i *) (r - 12));
+            _mm_storeu_si128((__m128i *) l, _mm_shuffle_epi32(b, 0x1b));
+            _mm_storeu_si128((__m128i *) (r - 12), _mm_shuffle_epi32(a, 0x1b));
+        }
+        for (; l < r; l += 4, r -= 4) swap_pixels<4>(l, r);
+    }
+#endif
+
+#ifdef __SSE2__
+    // the SSSE3 loops below are built whatever the compiler flags, and taken when the CPU has it; each leaves
+    // the pixels it didn't get to to the scalar loop of its caller
+    bool has_ssse3() {
+        static const bool yes = (__builtin_cpu_init(), __builtin_cpu_supports("ssse3"));
+        return yes;
+    }
+
+    __attribute__((target("ssse3")))
+    void reverse_bytes_ssse3(unsigned char *&l, unsigned char *&r) {
+        const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+        for (; r - l >= 31; l += 16, r -= 16) {
+            __m128i a = _mm_loadu_si128((__m128i *) l), b = _mm_loadu_si128((__m128i *) (r - 15));
+            _mm_storeu_si128((__m128i *) l, _mm_shuffle_epi8(b, reverse));
+            _mm_storeu_si128((__m128i *) (r - 15), _mm_shuffle_epi8(a, reverse));
+        }
+    }
+
+    // 5 pixels (15 bytes) from each end at a time, the 16th byte of each load is put back as it was
+    __attribute__((target("ssse3")))
+    void reverse_rgb_ssse3(unsigned char *&l, unsigned char *&r) {
+        const __m128i to_left = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, -1);
+        const __m128i to_right = _mm_setr_epi8(-1, 12, 13, 14, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2);
+        const __m128i last = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1);
+        const __m128i first = _mm_setr_epi8(-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        for (; r - l >= 30; l += 15, r -= 15) {
+            __m128i a = _mm_loadu_si128((__m128i *) l), b = _mm_loadu_si128((__m128i *) (r - 13));
+            _mm_storeu_si128((__m128i *) l, _mm_or_si128(_mm_shuffle_epi8(b, to_left), _mm_and_si128(a, last)));
+            _mm_storeu_si128((__m128i *) (r - 13), _mm_or_si128(_mm_shuffle_epi8(a, to_right), _mm_and_si128(b, first)));
+        }
+    }
+
+    // bytes [i, last) of BGRA pixels
+    __attribute__((target("ssse3")))
+    void swap_red_blue_ssse3(unsigned char *p, size_t &i, size_t last) {
+        const __m128i swap = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+        for (; i + 16 <= last; i += 16) {
+            _mm_storeu_si128((__m128i *) (p + i), _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (p + i)), swap));
+        }
+    }
+
+    // 4 pixels from 12 of the 16 bytes loaded
+    __attribute__((target("ssse3")))
+    void rgb_to_rgba_ssse3(const unsigned char *&src, unsigned char *&dst, size_t &i, size_t last) {
+        const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        const __m128i opaque = _mm_set1_epi32(static_cast<int>(0xff000000));
+        for (; i + 6 <= last; i += 4, src += 12, dst += 16) {
+            __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) src), spread);
+            _mm_storeu_si128((__m128i *) dst, _mm_or_si128(v, opaque));
+        }
+    }
+
+    // 12 bytes stored out of 16, the rest is written by the next ones
+    __attribute__((target("ssse3")))
+    void rgba_to_rgb_ssse3(const unsigned char *&src, unsigned char *&dst, size_t &i, size_t last) {
+        const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        for (; i + 6 <= last; i += 4, src += 16, dst += 12) {
+            _mm_storeu_si128((__m128i *) dst, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) src), pack));
+        }
+    }
+
+    template<>
+    void reverse_row<1>(unsigned char *l, unsigned char *r) {
+        if (has_ssse3()) reverse_bytes_ssse3(l, r);
+        for (; l < r; l++, r--) std::swap(*l, *r);
+    }
+
+    template<>
+    void reverse_row<3>(unsigned char *l, unsigned char *r) {
+        if (has_ssse3()) reverse_rgb_ssse3(l, r);
+        for (; l < r; l += 3, r -= 3) swap_pixels<3>(l, r);
+    }
+#endif
+
+    template<int bpp>
+    void flip_rows(unsigned char *data, int width, int first, int last) {
+        for (int y = first; y < last; y++) {
+            unsigned char *row = data + static_cast<size_t>(y) * width * bpp;
+            reverse_row<bpp>(row, row + (width - 1) * bpp);
+        }
+    }
+
+    // bytes [first, last) of BGR(A) pixels
+    template<int bpp>
+    void swap_red_blue_bytes(unsigned char *p, size_t first, size_t last) {
+        size_t i = first;
+#ifdef __SSE2__
+        // RGB is left to the scalar loop, which the compiler vectorizes: 16 byte stores 15 bytes apart stall
+        // the loads that follow them
+        if (bpp == 4 && has_ssse3()) swap_red_blue_ssse3(p, i, last);
+#endif
+        for (; i < last; i += bpp) std::swap(p[i], p[i + 2]);
+    }
+
+    // pixels [first, last) from in bytes per pixel to out
+    void convert_pixels(const unsigned char *src, int in, unsigned char *dst, int out, size_t first, size_t last) {
+        src += first * in, dst += first * out;
+        size_t i = first;
+#ifdef __SSE2__
+        if (in == 3 && out == 4 && has_ssse3()) rgb_to_rgba_ssse3(src, dst, i, last);
+        if (in == 4 && out == 3 && has_ssse3()) rgba_to_rgb_ssse3(src, dst, i, last);
+#endif
+        for (; i < last; i++, src += in, dst += out) {
+            if (out == TGAImage::GRAYSCALE) {
+                dst[0] = in == TGAImage::GRAYSCALE ? src[0] : (29 * src[0] + 150 * src[1] + 77 * src[2] + 128) >> 8;
+                continue;
+            }
+            for (int c = 0; c < 3; c++) dst[c] = src[in == TGAImage::GRAYSCALE ? 0 : c];
+            if (out == TGAImage::RGBA) dst[3] = in == TGAImage::RGBA ? src[3] : 255;
+        }
+    }
+
+    // the source pixels of every destination pixel along one axis: count[i] of them from first[i], with the weights
+    // from offset[i], summing to 1
+    struct Taps {
+        std::vector<int> first, count, offset;
+        std::vector<float> weights;
+
+        Taps(int from, int to, TGAImage::Filter filter) {
+            const float step = float(from) / to;
+            for (int i = 0; i < to; i++) {
+                offset.push_back(static_cast<int>(weights.size()));
+                if (filter == TGAImage::BOX) { // the overlap of [i, i + 1) scaled back with every source pixel
+                    float lo = i * step, hi = std::min(lo + step, float(from));
+                    int a = static_cast<int>(lo), b = std::max(a, std::min(from - 1, static_cast<int>(ceilf(hi)) - 1));
+                    first.push_back(a);
+                    count.push_back(b - a + 1);
+                    for (int k = a; k <= b; k++) weights.push_back(std::max(0.f, std::min(hi, k + 1.f) - std::max(lo, float(k))) / step);
+                    continue;
+                }
+                float c = (i + .5f) * step - .5f; // bilinear, the edge pixels are repeated
+                int k = static_cast<int>(floorf(c));
+                float f = c - k;
+                if (k < 0 || k + 1 > from - 1) {
+                    first.push_back(std::max(0, std::min(k + (k >= 0), from - 1)));
+                    count.push_back(1);
+                    weights.push_back(1.f);
+                } else {
+                    first.push_back(k);
+                    count.push_back(2);
+                    weights.push_back(1.f - f);
+                    weights.push_back(f);
+                }
+            }
+        }
+    };
+
+    template<int bpp>
+    void resample(const unsigned char *src, int width, int height, unsigned char *dst, int w, int h,
+                  TGAImage::Filter filter) {
+        const Taps tx(width, w, filter), ty(height, h, filter);
+        std::vector<float> rows(static_cast<size_t>(w) * height * bpp); // filtered along x
+        parallel_rows(height, rows.size() * sizeof(float), [&](int first, int last) {
+            for (int y = first; y < last; y++) {
+                const unsigned char *in = src + static_cast<size_t>(y) * width * bpp;
+                float *out = &rows[static_cast<size_t>(y) * w * bpp];
+                for (int x = 0; x < w; x++, out += bpp) {
+                    const float *wt = &tx.weights[tx.offset[x]];
+                    const unsigned char *p = in + tx.first[x] * bpp;
+                    float acc[bpp] = {};
+                    for (int k = 0; k < tx.count[x]; k++, p += bpp) {
+                        for (int c = 0; c < bpp; c++) acc[c] += wt[k] * p[c];
+                    }
+                    for (int c = 0; c < bpp; c++) out[c] = acc[c];
+                }
+            }
+        });
+        const size_t line = static_cast<size_t>(w) * bpp;
+        parallel_rows(h, line * h, [&](int first, int last) {
+            std::vector<float> acc(line);
+            for (int y = first; y < last; y++) {
+                std::fill(acc.begin(), acc.end(), 0.f);
+                const float *wt = &ty.weights[ty.offset[y]];
+                for (int k = 0; k < ty.count[y]; k++) {
+                    const float *in = &rows[(ty.first[y] + k) * line];
+                    for (size_t i = 0; i < line; i++) acc[i] += wt[k] * in[i];
+                }
+                unsigned char *out = dst + y * line;
+                for (size_t i = 0; i < line; i++) out[i] = static_cast<unsigned char>(std::min(255.f, acc[i] + .5f));
+            }
+        });
+    }
+}
 
 TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) {}
 
@@ -37,6 +350,7 @@ TGAImage &TGAImage::operator=(const TGAImage &img) {
 }
 
 bool TGAImage::read_tga_file(const char *filename) {
+    TRACE_SCOPE("tga read");
     if (data) delete[] data;
     data = NULL;
     std::ifstream in;
@@ -141,7 +455,8 @@ bool TGAImage::load_rle_data(std::ifstream &in) {
     return true;
 }
 
-bool TGAImage::write_tga_file(const char *filename, bool rle) {
+bool TGAImage::write_tga_file(const char *filename, bool rle, bool bottom_left) {
+    TRACE_SCOPE("tga write");
     unsigned char developer_area_ref[4] = {0, 0, 0, 0};
     unsigned char extension_area_ref[4] = {0, 0, 0, 0};
     unsigned char footer[18] = {'T', 'R', 'U', 'E', 'V', 'I', 'S', 'I', 'O', 'N', '-', 'X', 'F', 'I', 'L', 'E', '.',
@@ -159,7 +474,7 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
     header.width = width;
     header.height = height;
     header.datatypecode = (bytespp == GRAYSCALE ? (rle ? 11 : 3) : (rle ? 10 : 2));
-    header.imagedescriptor = 0x20; // top-left origin
+    header.imagedescriptor = bottom_left ? 0x00 : 0x20; // bottom-left or top-left origin
     out.write((char *) &header, sizeof(header));
     if (!out.good()) {
         out.close();
@@ -273,32 +588,64 @@ int TGAImage::get_height() {
 }
 
 bool TGAImage::flip_horizontally() {
+    TRACE_SCOPE("tga flip horizontally");
     if (!data) return false;
-    int half = width >> 1;
-    for (int i = 0; i < half; i++) {
-        for (int j = 0; j < height; j++) {
-            TGAColor c1 = get(i, j);
-            TGAColor c2 = get(width - 1 - i, j);
-            set(i, j, c2);
-            set(width - 1 - i, j, c1);
+    parallel_rows(height, static_cast<size_t>(width) * height * bytespp, [this](int first, int last) {
+        switch (bytespp) {
+            case GRAYSCALE:
+                flip_rows<1>(data, width, first, last);
+                break;
+            case RGB:
+                flip_rows<3>(data, width, first, last);
+                break;
+            case RGBA:
+                flip_rows<4>(data, width, first, last);
+                break;
         }
-    }
+    });
     return true;
 }
 
 bool TGAImage::flip_vertically() {
+    TRACE_SCOPE("tga flip");
     if (!data) return false;
     unsigned long bytes_per_line = width * bytespp;
-    unsigned char *line = new unsigned char[bytes_per_line];
     int half = height >> 1;
-    for (int j = 0; j < half; j++) {
-        unsigned long l1 = j * bytes_per_line;
-        unsigned long l2 = (height - 1 - j) * bytes_per_line;
-        memmove((void *) line, (void *) (data + l1), bytes_per_line);
-        memmove((void *) (data + l1), (void *) (data + l2), bytes_per_line);
-        memmove((void *) (data + l2), (void *) line, bytes_per_line);
-    }
-    delete[] line;
+    parallel_rows(half, bytes_per_line * height, [&](int first, int last) {
+        for (int j = first; j < last; j++) {
+            unsigned char *l1 = data + j * bytes_per_line;
+            std::swap_ranges(l1, l1 + bytes_per_line, data + (height - 1 - j) * bytes_per_line); // no scratch line
+        }
+    });
+    return true;
+}
+
+bool TGAImage::swap_red_blue() {
+    TRACE_SCOPE("tga swap red blue");
+    if (!data || bytespp < RGB) return false;
+    const size_t line = static_cast<size_t>(width) * bytespp;
+    parallel_rows(height, line * height, [&](int first, int last) {
+        if (bytespp == RGBA) {
+            swap_red_blue_bytes<4>(data, first * line, last * line);
+        } else {
+            swap_red_blue_bytes<3>(data, first * line, last * line);
+        }
+    });
+    return true;
+}
+
+bool TGAImage::convert(int bpp) {
+    TRACE_SCOPE("tga convert");
+    if (!data || (bpp != GRAYSCALE && bpp != RGB && bpp != RGBA)) return false;
+    if (bpp == bytespp) return true;
+    unsigned char *tdata = new unsigned char[static_cast<size_t>(width) * height * bpp];
+    const size_t pixels = static_cast<size_t>(width) * height;
+    parallel_rows(height, pixels * std::max(bpp, bytespp), [&](int first, int last) {
+        convert_pixels(data, bytespp, tdata, bpp, first * static_cast<size_t>(width), last * static_cast<size_t>(width));
+    });
+    delete[] data;
+    data = tdata;
+    bytespp = bpp;
     return true;
 }
 
@@ -310,8 +657,41 @@ void TGAImage::clear() {
     memset((void *) data, 0, width * height * bytespp);
 }
 
-bool TGAImage::scale(int w, int h) {
+bool TGAImage::scale_to(TGAImage &target, Filter filter) {
+    TRACE_SCOPE("tga scale");
+    if (!data || !target.data || target.bytespp != bytespp) return false;
+    if (filter == NEAREST) {
+        TGAImage copy(*this);
+        if (!copy.scale(target.width, target.height)) return false;
+        memcpy(target.data, copy.data, static_cast<size_t>(target.width) * target.height * bytespp);
+        return true;
+    }
+    switch (bytespp) {
+        case GRAYSCALE:
+            resample<1>(data, width, height, target.data, target.width, target.height, filter);
+            break;
+        case RGB:
+            resample<3>(data, width, height, target.data, target.width, target.height, filter);
+            break;
+        case RGBA:
+            resample<4>(data, width, height, target.data, target.width, target.height, filter);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+bool TGAImage::scale(int w, int h, Filter filter) {
     if (w <= 0 || h <= 0 || !data) return false;
+    if (filter != NEAREST) {
+        TGAImage scaled(w, h, bytespp);
+        if (!scale_to(scaled, filter)) return false;
+        std::swap(data, scaled.data);
+        width = w;
+        height = h;
+        return true;
+    }
     unsigned char *tdata = new unsigned char[w * h * bytespp];
     int nscanline = 0;
     int oscanline = 0;
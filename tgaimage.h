@@ -78,6 +78,12 @@ public:
         GRAYSCALE = 1, RGB = 3, RGBA = 4
     };
 
+    // NEAREST picks one source pixel, BOX averages the ones a destination pixel covers, weighted by how much of
+    // them it covers, BILINEAR interpolates the 2x2 nearest to its center
+    enum Filter {
+        NEAREST, BOX, BILINEAR
+    };
+
     TGAImage();
 
     TGAImage(int w, int h, int bpp);
@@ -86,13 +92,27 @@ public:
 
     bool read_tga_file(const char *filename);
 
-    bool write_tga_file(const char *filename, bool rle = true);
+    // bottom_left declares the first row as the bottom one, the same file as flip_vertically() and a default
+    // write but without the pass over the image
+    bool write_tga_file(const char *filename, bool rle = true, bool bottom_left = false);
 
+    // The transforms below split large images in bands of rows over a pool of one thread per core shared by every
+    // image, and go through SSE registers where the pixel size allows.
     bool flip_horizontally();
 
     bool flip_vertically();
 
-    bool scale(int w, int h);
+    bool scale(int w, int h, Filter filter = NEAREST);
+
+    // into target, at its size, with the same bytes per pixel, for supersampled and thumbnail output
+    bool scale_to(TGAImage &target, Filter filter);
+
+    // to another number of bytes per pixel: color to GRAYSCALE keeps the luma, GRAYSCALE to color repeats it,
+    // RGBA to RGB drops the alpha and RGB to RGBA makes it opaque
+    bool convert(int bpp);
+
+    // BGR(A) to RGB(A), and back
+    bool swap_red_blue();
 
     TGAColor get(int x, int y);
 
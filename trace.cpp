@@ -0,0 +1,121 @@
+#include "trace.h"
+
+#ifdef TINYRENDERER_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+    struct Event {
+        const char *name;
+        long long begin;
+        long long end;
+    };
+
+    // written by its thread only, count is published after the event so a dump can read along
+    struct Chunk {
+        static const int SIZE = 4096;
+        Event events[SIZE];
+        std::atomic<int> count{0};
+        std::atomic<Chunk *> next{nullptr};
+    };
+
+    struct Buffer {
+        int tid;
+        Chunk *head;
+        Chunk *tail;
+    };
+
+    bool dump(std::vector<Buffer *> &buffers, const char *filename) {
+        std::ofstream out(filename);
+        if (!out.is_open()) {
+            std::cerr << "can't open file " << filename << "\n";
+            return false;
+        }
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        const char *separator = "\n";
+        for (Buffer *buffer : buffers) {
+            for (Chunk *c = buffer->head; c; c = c->next.load(std::memory_order_acquire)) {
+                int n = c->count.load(std::memory_order_acquire);
+                for (int i = 0; i < n; i++) {
+                    const Event &e = c->events[i];
+                    out << separator << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":" << getpid()
+                        << ",\"tid\":" << buffer->tid << ",\"ts\":" << e.begin / 1000.
+                        << ",\"dur\":" << (e.end - e.begin) / 1000. << "}";
+                    separator = ",\n";
+                }
+            }
+        }
+        out << "\n]}\n";
+        return out.good();
+    }
+
+    // the buffers are never freed, so the spans of the threads that are gone are still dumped
+    struct Registry {
+        std::mutex mutex;
+        std::vector<Buffer *> buffers;
+
+        ~Registry() {
+            const char *filename = std::getenv("TINYRENDERER_TRACE_FILE");
+            std::lock_guard<std::mutex> lock(mutex);
+            if (filename) dump(buffers, filename);
+        }
+    };
+
+    Registry &registry() {
+        static Registry r;
+        return r;
+    }
+
+    Buffer *thread_buffer() {
+        thread_local Buffer *buffer = nullptr;
+        if (!buffer) {
+            Chunk *chunk = new Chunk();
+            buffer = new Buffer{0, chunk, chunk};
+            Registry &r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            buffer->tid = (int) r.buffers.size() + 1;
+            r.buffers.push_back(buffer);
+        }
+        return buffer;
+    }
+}
+
+long long trace::now() {
+    static const auto epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void trace::record(const char *name, long long begin, long long end) {
+    Buffer *buffer = thread_buffer();
+    Chunk *tail = buffer->tail;
+    int n = tail->count.load(std::memory_order_relaxed);
+    if (n == Chunk::SIZE) {
+        Chunk *next = new Chunk();
+        tail->next.store(next, std::memory_order_release);
+        buffer->tail = tail = next;
+        n = 0;
+    }
+    tail->events[n] = {name, begin, end};
+    tail->count.store(n + 1, std::memory_order_release);
+}
+
+bool trace_dump(const char *filename) {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return dump(r.buffers, filename);
+}
+
+#else
+
+bool trace_dump(const char *) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#pragma once
+
+// Spans for chrome://tracing or ui.perfetto.dev, compiled in with TINYRENDERER_TRACE defined
+// (cmake -DTINYRENDERER_TRACE=ON), otherwise TRACE_SCOPE expands to nothing.
+// TRACE_SCOPE("name") records a span from there to the end of the enclosing scope on the calling thread. The name
+// must be a string literal. Every thread appends to its own buffer, no lock is taken while recording.
+// trace_dump() writes everything recorded so far as trace event JSON, the file named by the TINYRENDERER_TRACE_FILE
+// environment variable (if any) is written at exit.
+
+#ifdef TINYRENDERER_TRACE
+
+namespace trace {
+    long long now();
+
+    void record(const char *name, long long begin, long long end);
+
+    struct Scope {
+        const char *name;
+        long long begin;
+
+        explicit Scope(const char *name) : name(name), begin(now()) {}
+
+        ~Scope() { record(name, begin, now()); }
+    };
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#else
+
+#define TRACE_SCOPE(name)
+
+#endif
+
+// false when the file can't be written or tracing is compiled out
+bool trace_dump(const char *filename);